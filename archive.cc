@@ -0,0 +1,347 @@
+/* archive.cc - Convert files into a single tar archive
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "archive.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <set>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "fileutils.h"
+#include "workers.h"
+
+using namespace std;
+
+// The first line of the index entry.
+#define INDEX_MAGIC "lloconv archive index 1"
+
+#define TAR_BLOCK 512
+
+namespace {
+
+// Writes a POSIX (ustar) tar archive, using pax extended headers for names
+// and sizes which ustar can't represent.
+class tar_writer {
+    int fd;
+
+    bool ok = true;
+
+    time_t mtime;
+
+    bool write_all(const void * buf, size_t count) {
+	const char * p = static_cast<const char *>(buf);
+	while (ok && count) {
+	    ssize_t r = write(fd, p, count);
+	    if (r < 0) {
+		if (errno == EINTR) continue;
+		ok = false;
+		break;
+	    }
+	    p += r;
+	    count -= r;
+	}
+	return ok;
+    }
+
+    bool pad(uint64_t size) {
+	static const char zeros[TAR_BLOCK] = {};
+	size_t rem = size % TAR_BLOCK;
+	return rem == 0 || write_all(zeros, TAR_BLOCK - rem);
+    }
+
+    static void octal(char * field, size_t len, uint64_t value) {
+	snprintf(field, len, "%0*llo", int(len - 1),
+		 static_cast<unsigned long long>(value));
+    }
+
+    // Split name between the ustar prefix and name fields if we can.
+    static bool split_name(const string & name, string & prefix,
+			   string & leaf) {
+	if (name.size() <= 100) {
+	    prefix.clear();
+	    leaf = name;
+	    return true;
+	}
+	string::size_type slash = name.find('/', name.size() - 101);
+	if (slash == string::npos || slash > 155 || slash == 0) return false;
+	prefix.assign(name, 0, slash);
+	leaf.assign(name, slash + 1, string::npos);
+	return !leaf.empty();
+    }
+
+    bool write_header(const string & name, uint64_t size, char type) {
+	char h[TAR_BLOCK];
+	memset(h, 0, sizeof(h));
+	string prefix, leaf;
+	if (!split_name(name, prefix, leaf)) {
+	    // A pax header gives the full name.
+	    prefix.clear();
+	    leaf.assign(name, 0, 100);
+	}
+	memcpy(h, leaf.data(), min(leaf.size(), size_t(100)));
+	octal(h + 100, 8, 0644);
+	octal(h + 108, 8, 0);
+	octal(h + 116, 8, 0);
+	octal(h + 124, 12, size);
+	octal(h + 136, 12, mtime);
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	memcpy(h + 345, prefix.data(), min(prefix.size(), size_t(155)));
+	memset(h + 148, ' ', 8);
+	unsigned sum = 0;
+	for (unsigned char ch : h) sum += ch;
+	snprintf(h + 148, 8, "%06o", sum);
+	return write_all(h, sizeof(h));
+    }
+
+    // Append a pax extended header record, whose length includes itself.
+    static void pax_record(string & out, const char * key,
+			   const string & value) {
+	size_t len = strlen(key) + value.size() + 3;
+	size_t total = len + 1;
+	while (to_string(total).size() + len != total) ++total;
+	out += to_string(total);
+	out += ' ';
+	out += key;
+	out += '=';
+	out += value;
+	out += '\n';
+    }
+
+  public:
+    explicit tar_writer(int fd_) : fd(fd_), mtime(time(NULL)) { }
+
+    bool good() const { return ok; }
+
+    // Start an entry of size bytes, which the caller must then write.
+    bool start_entry(const string & name, uint64_t size) {
+	string prefix, leaf;
+	bool long_size = size >= (uint64_t(1) << 33);
+	string pax;
+	if (!split_name(name, prefix, leaf)) pax_record(pax, "path", name);
+	if (long_size) pax_record(pax, "size", to_string(size));
+	if (!pax.empty()) {
+	    if (!write_header("PaxHeader", pax.size(), 'x') ||
+		!write_all(pax.data(), pax.size()) ||
+		!pad(pax.size())) {
+		return false;
+	    }
+	}
+	return write_header(name, long_size ? 0 : size, '0');
+    }
+
+    bool add_data(const string & name, const string & data) {
+	return start_entry(name, data.size()) &&
+	       write_all(data.data(), data.size()) &&
+	       pad(data.size());
+    }
+
+    bool add_file(const string & name, const string & path) {
+	int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0) return false;
+	struct stat sb;
+	if (fstat(in, &sb) < 0 || !start_entry(name, sb.st_size)) {
+	    close(in);
+	    return false;
+	}
+	// The header has promised st_size bytes, so write exactly that many
+	// even if the file changes under us.
+	uint64_t left = sb.st_size;
+	char buf[65536];
+	while (left && ok) {
+	    ssize_t n = read(in, buf, min(uint64_t(sizeof(buf)), left));
+	    if (n < 0 && errno == EINTR) continue;
+	    if (n <= 0) {
+		memset(buf, 0, sizeof(buf));
+		n = min(uint64_t(sizeof(buf)), left);
+	    }
+	    write_all(buf, n);
+	    left -= n;
+	}
+	close(in);
+	return pad(sb.st_size);
+    }
+
+    bool finish() {
+	static const char zeros[TAR_BLOCK * 2] = {};
+	return write_all(zeros, sizeof(zeros));
+    }
+};
+
+}
+
+// The archive entry name for input, without the extension - its path with
+// any leading '/' and any "." and ".." components dropped, so it can't
+// extract outside the current directory.
+static string
+entry_stem(const string & input)
+{
+    string name;
+    string::size_type i = 0;
+    while (i < input.size()) {
+	string::size_type j = input.find('/', i);
+	if (j == string::npos) j = input.size();
+	string component(input, i, j - i);
+	if (!component.empty() && component != "." && component != "..") {
+	    if (!name.empty()) name += '/';
+	    name += component;
+	}
+	i = j + 1;
+    }
+    if (name.empty()) name = "output";
+    return name;
+}
+
+// Entry names for inputs.  Different inputs can give the same name (e.g.
+// "a/x.txt" and "../a/x.txt"), so add a number to repeats to stop one
+// overwriting another when extracted.
+static vector<string>
+entry_names(const vector<string> & inputs, const char * format)
+{
+    vector<string> names;
+    set<string> used;
+    for (size_t i = 0; i != inputs.size(); ++i) {
+	string stem = entry_stem(inputs[i]);
+	string name = stem + '.' + format;
+	for (size_t n = i + 1; used.count(name); ++n) {
+	    name = stem + '-' + to_string(n) + '.' + format;
+	}
+	used.insert(name);
+	names.push_back(name);
+    }
+    return names;
+}
+
+// Append s to the index, escaping characters which would confuse its
+// tab-separated line-based format.
+static void
+append_escaped(string & out, const string & s)
+{
+    for (char ch : s) {
+	switch (ch) {
+	    case '\\':
+		out += "\\\\";
+		break;
+	    case '\n':
+		out += "\\n";
+		break;
+	    case '\t':
+		out += "\\t";
+		break;
+	    default:
+		out += ch;
+	}
+    }
+}
+
+int
+convert_archive(const vector<string> & inputs, const char * archive,
+		const char * format, const char * options,
+		unsigned jobs, bool verbose)
+{
+    int fd;
+    if (strcmp(archive, "-") == 0) {
+	if (isatty(1)) {
+	    cerr << program << ": Not writing an archive to a terminal\n";
+	    return 1;
+	}
+	// Write the archive to a copy of stdout and point stdout at stderr,
+	// so anything LibreOffice prints in the workers (which inherit it)
+	// can't corrupt the archive.
+	fd = fcntl(1, F_DUPFD_CLOEXEC, 3);
+	if (fd < 0 || dup2(2, 1) < 0) {
+	    perror("dup");
+	    return 1;
+	}
+    } else {
+	fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+	    cerr << program << ": Failed to create '" << archive << "' ("
+		 << strerror(errno) << ")\n";
+	    return 1;
+	}
+    }
+
+    // Conversions are written here first, then copied into the archive and
+    // removed.
+    const char * p = getenv("TMPDIR");
+    string tmpdir = p ? p : "/tmp";
+    tmpdir += "/lloconv-archive-XXXXXX";
+    if (!mkdtemp(&tmpdir[0])) {
+	cerr << program << ": mkdtemp() failed (" << strerror(errno) << ")\n";
+	close(fd);
+	return 1;
+    }
+    auto tmp_output = [&](size_t i) {
+	return tmpdir + '/' + to_string(i) + '.' + format;
+    };
+
+    tar_writer tar(fd);
+    vector<string> names = entry_names(inputs, format);
+    vector<bool> ok(inputs.size());
+    size_t converted = 0, failed = 0;
+    run_workers(inputs.size(), jobs,
+		[&](void * handle, size_t i) -> int {
+		    return convert(handle, false, inputs[i].c_str(),
+				   tmp_output(i).c_str(), format, options);
+		},
+		[&](size_t i, int status) {
+		    string output = tmp_output(i);
+		    if (status == 0 && tar.good()) {
+			ok[i] = tar.add_file(names[i], output);
+		    }
+		    unlink(output.c_str());
+		    if (ok[i]) {
+			++converted;
+		    } else {
+			cerr << program << ": Failed to convert '"
+			     << inputs[i] << "'\n";
+			++failed;
+		    }
+		});
+
+    // The index lists every input, in the order given, as:
+    // STATUS <tab> ENTRY NAME <tab> INPUT PATH
+    string index = INDEX_MAGIC "\n";
+    for (size_t i = 0; i < inputs.size(); ++i) {
+	index += ok[i] ? "ok\t" : "failed\t";
+	append_escaped(index, names[i]);
+	index += '\t';
+	append_escaped(index, inputs[i]);
+	index += '\n';
+    }
+    tar.add_data(ARCHIVE_INDEX_NAME, index);
+    tar.finish();
+    bool written = tar.good();
+    if (close(fd) < 0) written = false;
+    if (!written) {
+	cerr << program << ": Failed to write archive '" << archive << "' ("
+	     << strerror(errno) << ")\n";
+    }
+    remove_tree(tmpdir);
+
+    if (verbose) {
+	cerr << program << ": " << converted << " converted, "
+	     << failed << " failed\n";
+    }
+    return (failed || !written) ? 1 : 0;
+}
@@ -0,0 +1,30 @@
+/* archive.h - Convert files into a single tar archive
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_ARCHIVE_H
+#define INCLUDED_ARCHIVE_H
+
+#include <string>
+#include <vector>
+
+// Name of the entry at the end of the archive which lists how each
+// conversion went.
+#define ARCHIVE_INDEX_NAME "lloconv-index.txt"
+
+// Convert each of inputs to format, writing the results to a tar archive at
+// path archive ("-" for stdout).  Each is added as soon as it's converted,
+// named after its input path with "." + format appended (with "-N" added
+// before that if the name repeats an earlier one), and the archive ends
+// with an index entry.  Returns an exit status.
+int convert_archive(const std::vector<std::string> & inputs,
+		    const char * archive,
+		    const char * format, const char * options,
+		    unsigned jobs, bool verbose);
+
+#endif
@@ -0,0 +1,103 @@
+/* budget.cc - Estimate how much memory conversions will need
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "budget.h"
+
+#include <cctype>
+#include <cstdlib>
+
+using namespace std;
+
+// Initial guess at the cost of converting a tiny file, beyond what the
+// preinitialised parent process already uses.
+#define DEFAULT_OVERHEAD (200ULL << 20)
+
+// Initial guesses at memory used per byte of input.  Spreadsheets are
+// typically stored much more compactly than they are held in memory.
+#define DEFAULT_RATIO 20.0
+#define SPREADSHEET_RATIO 100.0
+
+// Weight given to each new observation.
+#define LEARNING_RATE 0.3
+
+uint64_t
+parse_size(const char * s)
+{
+    char * end;
+    double v = strtod(s, &end);
+    if (end == s || v <= 0) return 0;
+    switch (toupper(static_cast<unsigned char>(*end))) {
+	case 'T':
+	    v *= 1024.0;
+	    // Fall through.
+	case 'G':
+	    v *= 1024.0;
+	    // Fall through.
+	case 'M':
+	    v *= 1024.0;
+	    // Fall through.
+	case 'K':
+	    v *= 1024.0;
+	    ++end;
+	    break;
+    }
+    if (*end) return 0;
+    return uint64_t(v);
+}
+
+memory_model::memory_model()
+    : overhead(DEFAULT_OVERHEAD)
+{
+    static const char * const spreadsheets[] = {
+	"csv", "fods", "ods", "ots", "xls", "xlsb", "xlsm", "xlsx", "xlt",
+	"xltx"
+    };
+    for (const char * type : spreadsheets) {
+	ratio[type] = SPREADSHEET_RATIO;
+    }
+}
+
+string
+memory_model::file_type(const string & path)
+{
+    string::size_type dot = path.rfind('.');
+    if (dot == string::npos || path.find('/', dot) != string::npos) {
+	return string();
+    }
+    string type(path, dot + 1);
+    for (char & ch : type) {
+	ch = tolower(static_cast<unsigned char>(ch));
+    }
+    return type;
+}
+
+uint64_t
+memory_model::estimate(const string & type, uint64_t size) const
+{
+    auto i = ratio.find(type);
+    double r = i == ratio.end() ? DEFAULT_RATIO : i->second;
+    return overhead + uint64_t(r * size);
+}
+
+void
+memory_model::observe(const string & type, uint64_t size, uint64_t used)
+{
+    auto i = ratio.find(type);
+    double r = i == ratio.end() ? DEFAULT_RATIO : i->second;
+    if (r * size < overhead / 10) {
+	// Small enough that what it used is mostly the fixed overhead.
+	overhead = uint64_t((1 - LEARNING_RATE) * overhead +
+			    LEARNING_RATE * used);
+	return;
+    }
+    double sample = used > overhead ? double(used - overhead) / size : 0.0;
+    ratio[type] = (1 - LEARNING_RATE) * r + LEARNING_RATE * sample;
+}
@@ -0,0 +1,43 @@
+/* budget.h - Estimate how much memory conversions will need
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_BUDGET_H
+#define INCLUDED_BUDGET_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+// Parse a size in bytes with an optional K, M, G or T suffix.  Returns 0 if
+// s isn't valid.
+uint64_t parse_size(const char * s);
+
+// Predicts the peak memory use of converting a file from its size and type,
+// learning from the peak memory use actually observed.
+//
+// The model is: overhead + ratio[type] * input size, where overhead is what
+// converting even a tiny file costs and type is the file's extension.
+class memory_model {
+    uint64_t overhead;
+
+    std::map<std::string, double> ratio;
+
+  public:
+    memory_model();
+
+    // The type of file path, as used to look up the ratio.
+    static std::string file_type(const std::string & path);
+
+    uint64_t estimate(const std::string & type, uint64_t size) const;
+
+    // Update the model using the peak memory a conversion actually used.
+    void observe(const std::string & type, uint64_t size, uint64_t used);
+};
+
+#endif
@@ -11,10 +11,15 @@
 
 #include "convert.h"
 
+#include <cctype>
 #include <climits>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <iostream>
+#include <list>
+#include <map>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -22,8 +27,14 @@
 #include <unistd.h>
 #include <sysexits.h>
 
+// Document::getDocumentType(), getParts(), setPart() and getPartName() are
+// only declared if this is defined.
+#define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKit.hxx>
+#include <LibreOfficeKit/LibreOfficeKitEnums.h>
 
+#include "fileutils.h"
+#include "profile.h"
 #include "urlencode.h"
 
 using namespace std;
@@ -43,7 +54,7 @@ const char * program = "<program>";
 
 // Find a LibreOffice installation to use.
 static const char *
-get_lo_path()
+get_lo_path(string & errmsg)
 {
     const char * lo_path = getenv("LO_PATH");
     if (lo_path) return lo_path;
@@ -109,73 +120,424 @@ get_lo_path()
 	}
     }
 
-    cerr << program << ": LibreOffice install not found\n"
+    errmsg = "LibreOffice install not found\n"
 	"Set LO_PATH in the environment to the 'program' directory - e.g.:\n"
 	"LO_PATH=/opt/libreoffice/program\n"
-	"export LO_PATH\n";
-    _Exit(1);
+	"export LO_PATH";
+    return NULL;
 }
 
 void *
-convert_init()
+convert_init(string & errmsg)
 {
     Office * llo = NULL;
     try {
-	const char * lo_path = get_lo_path();
-	llo = lok_cpp_init(lo_path);
+	const char * lo_path = get_lo_path(errmsg);
+	if (!lo_path) {
+	    return NULL;
+	}
+	string profile;
+	if (!convert_profile_url(profile, errmsg)) {
+	    return NULL;
+	}
+	llo = lok_cpp_init(lo_path, profile.empty() ? NULL : profile.c_str());
 	if (!llo) {
-	    cerr << program << ": Failed to initialise LibreOfficeKit\n";
+	    errmsg = "Failed to initialise LibreOfficeKit";
 	    return NULL;
 	}
 	return static_cast<void*>(llo);
     } catch (const exception & e) {
 	delete llo;
-	cerr << program << ": LibreOfficeKit threw exception (" << e.what() << ")\n";
+	errmsg = "LibreOfficeKit threw exception (";
+	errmsg += e.what();
+	errmsg += ')';
 	return NULL;
     }
 }
 
+void *
+convert_init()
+{
+    string errmsg;
+    void * h = convert_init(errmsg);
+    if (!h) {
+	cerr << program << ": " << errmsg << '\n';
+    }
+    return h;
+}
+
+bool
+convert_preinit()
+{
+    string errmsg;
+    const char * lo_path = get_lo_path(errmsg);
+    string profile;
+    if (!lo_path || !convert_profile_url(profile, errmsg)) {
+	return false;
+    }
+    if (lok_preinit(lo_path, profile.empty() ? NULL : profile.c_str()) != 0) {
+	return false;
+    }
+    convert_profile_preinit();
+    return true;
+}
+
+namespace {
+
+// A loaded document kept for reuse.
+struct cached_doc {
+    Document * doc;
+
+    // Identity of the file when it was loaded.
+    int64_t mtime;
+    off_t size;
+
+    // Estimate of the memory the loaded document uses.
+    uint64_t bytes;
+
+    // How long loading it took, in seconds.
+    double load_time;
+
+    // Position in cache_lru.
+    list<string>::iterator lru;
+};
+
+}
+
+// Loaded documents, keyed by path and the load options, and a list of those
+// keys with the most recently used first.
+static map<string, cached_doc> cache;
+static list<string> cache_lru;
+
+static size_t cache_max_docs = 0;
+static uint64_t cache_max_bytes = 0;
+static uint64_t cache_bytes = 0;
+
+static convert_cache_stats cache_stats;
+
+// Our resident size in bytes, or 0 if unknown.
+static uint64_t
+resident_size()
+{
+    FILE * f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long pages = 0, resident = 0;
+    if (fscanf(f, "%lu %lu", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return uint64_t(resident) * sysconf(_SC_PAGESIZE);
+}
+
+static void
+cache_erase(map<string, cached_doc>::iterator i)
+{
+    delete i->second.doc;
+    cache_bytes -= i->second.bytes;
+    cache_lru.erase(i->second.lru);
+    cache.erase(i);
+}
+
+// Evict least recently used documents until there's room for one using
+// bytes.
+static void
+cache_make_room(uint64_t bytes)
+{
+    while (!cache.empty() &&
+	   (cache.size() >= cache_max_docs ||
+	    cache_bytes + bytes > cache_max_bytes)) {
+	cache_erase(cache.find(cache_lru.back()));
+	++cache_stats.evictions;
+    }
+}
+
+void
+convert_set_cache(size_t max_docs, uint64_t max_bytes)
+{
+    cache_max_docs = max_docs;
+    cache_max_bytes = max_bytes;
+    cache_make_room(0);
+}
+
+convert_cache_stats
+convert_get_cache_stats()
+{
+    return cache_stats;
+}
+
 void
 convert_cleanup(void * h_void)
 {
+    // The documents must go before the Office they belong to.
+    while (!cache.empty()) {
+	cache_erase(cache.begin());
+    }
     Office * llo = static_cast<Office *>(h_void);
     delete llo;
+    convert_discard_profile();
 }
 
-int
+string
+convert_output_format(const string & format, const string & output)
+{
+    string result;
+    if (!format.empty()) {
+	result = format;
+    } else {
+	string::size_type dot = output.rfind('.');
+	if (dot != string::npos && output.find('/', dot) == string::npos) {
+	    result.assign(output, dot + 1, string::npos);
+	}
+    }
+    for (char & ch : result) {
+	ch = tolower(static_cast<unsigned char>(ch));
+    }
+    return result;
+}
+
+// Append LibreOfficeKit's error message (if any) in brackets.
+static void
+append_lok_error(string & errmsg, Office * llo)
+{
+    const char * lok_errmsg = llo->getError();
+    errmsg += " (";
+    if (lok_errmsg) errmsg += lok_errmsg;
+    errmsg += ')';
+}
+
+convert_status
 convert(void * h_void, bool url,
 	const char * input, const char * output,
-	const char * format, const char * options)
+	const char * format, const char * options,
+	string & errmsg)
 try {
-    if (!h_void) return 1;
+    if (!h_void) {
+	errmsg = "LibreOfficeKit not initialised";
+	return CONVERT_NO_HANDLE;
+    }
     Office * llo = static_cast<Office *>(h_void);
 
-    string input_url;
-    if (url) {
-	input_url = input;
-    } else {
-	url_encode_path(input_url, input);
+    // We can only tell if a file has changed, not a URL.
+    string key;
+    struct stat sb;
+    bool cacheable = cache_max_docs && !url && stat(input, &sb) == 0;
+    map<string, cached_doc>::iterator cached = cache.end();
+    if (cacheable) {
+	key = input;
+	key += '\0';
+	if (options) key += options;
+	cached = cache.find(key);
+	if (cached != cache.end() &&
+	    (cached->second.mtime != stat_mtime(sb) ||
+	     cached->second.size != sb.st_size)) {
+	    // The file has changed since we loaded it.
+	    cache_erase(cached);
+	    cached = cache.end();
+	}
     }
-    Document * lodoc = llo->documentLoad(input_url.c_str(), options);
-    if (!lodoc) {
-	const char * errmsg = llo->getError();
-	cerr << program << ": LibreOfficeKit failed to load document (" << errmsg << ")\n";
-	return 1;
+
+    Document * lodoc;
+    if (cached != cache.end()) {
+	lodoc = cached->second.doc;
+	cache_lru.splice(cache_lru.begin(), cache_lru, cached->second.lru);
+	++cache_stats.hits;
+	cache_stats.load_time_saved += cached->second.load_time;
+    } else {
+	string input_url;
+	if (url) {
+	    input_url = input;
+	} else {
+	    url_encode_path(input_url, input);
+	}
+	double t = now();
+	uint64_t rss = cacheable ? resident_size() : 0;
+	lodoc = llo->documentLoad(input_url.c_str(), options);
+	if (!lodoc) {
+	    errmsg = "LibreOfficeKit failed to load document";
+	    append_lok_error(errmsg, llo);
+	    return CONVERT_LOAD_FAILED;
+	}
+	if (cacheable) {
+	    ++cache_stats.misses;
+	    cached_doc c;
+	    c.doc = lodoc;
+	    c.mtime = stat_mtime(sb);
+	    c.size = sb.st_size;
+	    c.load_time = now() - t;
+	    // How much our resident size grew is a rough measure, but better
+	    // than guessing from the file size, which is all we have to fall
+	    // back on.
+	    uint64_t new_rss = resident_size();
+	    c.bytes = new_rss > rss ? new_rss - rss : uint64_t(sb.st_size);
+	    if (c.bytes <= cache_max_bytes) {
+		cache_make_room(c.bytes);
+		cache_lru.push_front(key);
+		c.lru = cache_lru.begin();
+		cache_bytes += c.bytes;
+		cached = cache.insert(make_pair(key, c)).first;
+	    }
+	}
     }
 
     string output_url;
     url_encode_path(output_url, output);
     if (!lodoc->saveAs(output_url.c_str(), format, options)) {
-	const char * errmsg = llo->getError();
-	cerr << program << ": LibreOfficeKit failed to export (" << errmsg << ")\n";
+	errmsg = "LibreOfficeKit failed to export";
+	append_lok_error(errmsg, llo);
+	// Don't keep a document which we failed to export.
+	if (cached != cache.end()) {
+	    cache_erase(cached);
+	} else {
+	    delete lodoc;
+	}
+	return CONVERT_EXPORT_FAILED;
+    }
+
+    if (cached == cache.end()) {
 	delete lodoc;
-	return 1;
     }
 
+    return CONVERT_OK;
+} catch (const exception & e) {
+    errmsg = "LibreOfficeKit threw exception (";
+    errmsg += e.what();
+    errmsg += ')';
+    return CONVERT_EXCEPTION;
+}
+
+string
+convert_sheet_output(const char * output, int n, const char * sheet_name)
+{
+    string result = output;
+    string::size_type dot = result.rfind('.');
+    string::size_type slash = result.rfind('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+	dot = result.size();
+    }
+    string suffix = '-' + to_string(n) + '-';
+    for (const char * p = sheet_name; *p; ++p) {
+	unsigned char ch = *p;
+	// Keep bytes of UTF-8 multibyte sequences, so non-ASCII names survive.
+	if (isalnum(ch) || ch == '-' || ch == '_' || ch >= 0x80 ||
+	    (ch == '.' && p != sheet_name)) {
+	    suffix += char(ch);
+	} else {
+	    suffix += '_';
+	}
+    }
+    result.insert(dot, suffix);
+    return result;
+}
+
+// Load the spreadsheet input, setting status and errmsg and returning NULL
+// on failure.
+static Document *
+load_spreadsheet(void * h_void, const char * input, const char * options,
+		 convert_status & status, string & errmsg)
+{
+    if (!h_void) {
+	errmsg = "LibreOfficeKit not initialised";
+	status = CONVERT_NO_HANDLE;
+	return NULL;
+    }
+    Office * llo = static_cast<Office *>(h_void);
+
+    string input_url;
+    url_encode_path(input_url, input);
+    Document * lodoc = llo->documentLoad(input_url.c_str(), options);
+    if (!lodoc) {
+	errmsg = "LibreOfficeKit failed to load document";
+	append_lok_error(errmsg, llo);
+	status = CONVERT_LOAD_FAILED;
+	return NULL;
+    }
+    if (lodoc->getDocumentType() != LOK_DOCTYPE_SPREADSHEET) {
+	delete lodoc;
+	errmsg = "Not a spreadsheet";
+	status = CONVERT_NOT_SPREADSHEET;
+	return NULL;
+    }
+    return lodoc;
+}
+
+convert_status
+convert_count_sheets(void * h_void, const char * input, const char * options,
+		     int & nsheets, string & errmsg)
+try {
+    nsheets = 0;
+    convert_status status = CONVERT_OK;
+    Document * lodoc = load_spreadsheet(h_void, input, options, status,
+					errmsg);
+    if (!lodoc) {
+	return status;
+    }
+    nsheets = lodoc->getParts();
     delete lodoc;
+    return CONVERT_OK;
+} catch (const exception & e) {
+    errmsg = "LibreOfficeKit threw exception (";
+    errmsg += e.what();
+    errmsg += ')';
+    return CONVERT_EXCEPTION;
+}
 
-    return 0;
+convert_status
+convert_sheets(void * h_void, const char * input, const char * output,
+	       const char * format, const char * options,
+	       unsigned share, unsigned nshares,
+	       int & nsheets, string & errmsg)
+try {
+    nsheets = 0;
+    convert_status status = CONVERT_OK;
+    Document * lodoc = load_spreadsheet(h_void, input, options, status,
+					errmsg);
+    if (!lodoc) {
+	return status;
+    }
+    Office * llo = static_cast<Office *>(h_void);
+
+    nsheets = lodoc->getParts();
+    int first = int(uint64_t(nsheets) * share / nshares);
+    int last = int(uint64_t(nsheets) * (share + 1) / nshares);
+    for (int part = first; part < last; ++part) {
+	lodoc->setPart(part);
+	char * name = lodoc->getPartName(part);
+	string sheet_output =
+	    convert_sheet_output(output, part + 1, name ? name : "");
+	free(name);
+	string output_url;
+	url_encode_path(output_url, sheet_output);
+	if (!lodoc->saveAs(output_url.c_str(), format, options)) {
+	    // Carry on with the other sheets, but report the first failure.
+	    if (status == CONVERT_OK) {
+		errmsg = "LibreOfficeKit failed to export '" + sheet_output +
+			 "'";
+		append_lok_error(errmsg, llo);
+		status = CONVERT_EXPORT_FAILED;
+	    }
+	}
+    }
+    delete lodoc;
+    return status;
 } catch (const exception & e) {
-    cerr << program << ": LibreOfficeKit threw exception (" << e.what() << ")\n";
-    return 1;
+    errmsg = "LibreOfficeKit threw exception (";
+    errmsg += e.what();
+    errmsg += ')';
+    return CONVERT_EXCEPTION;
+}
+
+int
+convert(void * h_void, bool url,
+	const char * input, const char * output,
+	const char * format, const char * options)
+{
+    string errmsg;
+    if (convert(h_void, url, input, output, format, options, errmsg) !=
+	CONVERT_OK) {
+	// A NULL handle means convert_init() failed, which will already have
+	// been reported.
+	if (h_void) {
+	    cerr << program << ": " << errmsg << '\n';
+	}
+	return 1;
+    }
+    return 0;
 }
@@ -10,12 +10,90 @@
 #ifndef INCLUDED_CONVERT_H
 #define INCLUDED_CONVERT_H
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
 extern const char * program;
 
 void * convert_init();
+
+// Like convert_init(), but instead of reporting failure on stderr, set
+// errmsg to a description of it.
+void * convert_init(std::string & errmsg);
+
+// Load LibreOffice and do as much of its start-up as can safely be shared
+// with child processes created by fork() afterwards.  Full initialisation
+// starts threads, which don't survive fork(), so each child must still call
+// convert_init(), but that's much quicker after this has been done.
+bool convert_preinit();
+
 int convert(void * h_void, bool url,
 	    const char * input, const char * output,
 	    const char * format = 0, const char * options = 0);
+
+// The format convert() writes output in - format if given, otherwise the
+// extension of output, as LibreOfficeKit uses that when no format is given.
+// Lower-cased, so equal results mean the same format.
+std::string convert_output_format(const std::string & format,
+				  const std::string & output);
+
+enum convert_status {
+    CONVERT_OK = 0,
+    CONVERT_NO_HANDLE,
+    CONVERT_LOAD_FAILED,
+    CONVERT_EXPORT_FAILED,
+    CONVERT_EXCEPTION,
+    CONVERT_NOT_SPREADSHEET
+};
+
+// Like convert(), but instead of reporting failure on stderr, set errmsg to a
+// description of it and return the stage at which it failed.
+convert_status convert(void * h_void, bool url,
+		       const char * input, const char * output,
+		       const char * format, const char * options,
+		       std::string & errmsg);
+
+// The output path for sheet n (counting from 1) named sheet_name when
+// exporting each sheet of a spreadsheet to output - "-N-SHEETNAME" is
+// inserted before output's extension, with characters in the sheet name
+// which could cause problems in a filename replaced by '_'.
+std::string convert_sheet_output(const char * output, int n,
+				 const char * sheet_name);
+
+// Set nsheets to the number of sheets in the spreadsheet input.
+convert_status convert_count_sheets(void * h_void, const char * input,
+				    const char * options,
+				    int & nsheets, std::string & errmsg);
+
+// Export each of a share of the sheets of the spreadsheet input to the path
+// convert_sheet_output() gives.  The sheets are divided into nshares ranges
+// of consecutive sheets, and this exports the range numbered share (from 0),
+// so running this for every share in separate processes exports all the
+// sheets in parallel.  Each sheet is made the active one and then exported,
+// so this is only useful with filters which export just the active sheet,
+// such as CSV.  Sets nsheets to the number of sheets in the document.
+convert_status convert_sheets(void * h_void, const char * input,
+			      const char * output,
+			      const char * format, const char * options,
+			      unsigned share, unsigned nshares,
+			      int & nsheets, std::string & errmsg);
+
+// Keep up to max_docs documents (using an estimated max_bytes of memory in
+// total) loaded after converting them, so that converting the same file
+// again before it changes doesn't need to load it again.  Documents loaded
+// from URLs aren't kept.  The default is not to keep any.
+void convert_set_cache(size_t max_docs, uint64_t max_bytes);
+
+struct convert_cache_stats {
+    unsigned long hits = 0, misses = 0, evictions = 0;
+
+    // Total time the loads saved by cache hits originally took, in seconds.
+    double load_time_saved = 0;
+};
+
+convert_cache_stats convert_get_cache_stats();
+
 void convert_cleanup(void * h_void);
 
 #endif
@@ -0,0 +1,178 @@
+/* converter.cc - Asynchronous document conversion for embedding lloconv
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "converter.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "convert.h"
+
+using namespace std;
+
+namespace lloconv {
+
+struct Converter::Internal {
+    struct Entry {
+	Job job;
+
+	promise<Result> result;
+    };
+
+    size_t max_queued;
+
+    mutex m;
+
+    // Signalled when a job is queued or shutting_down is set.
+    condition_variable work_available;
+
+    // Signalled when a job is taken off the queue.
+    condition_variable space_available;
+
+    deque<Entry> queue;
+
+    bool shutting_down = false;
+
+    thread worker;
+
+    explicit Internal(size_t max_queued_)
+	: max_queued(max_queued_ ? max_queued_ : 1) { }
+
+    void run();
+};
+
+void
+Converter::Internal::run()
+{
+    string init_errmsg;
+    void * handle = convert_init(init_errmsg);
+
+    while (true) {
+	Entry entry;
+	{
+	    unique_lock<mutex> lock(m);
+	    work_available.wait(lock, [this] {
+		return !queue.empty() || shutting_down;
+	    });
+	    // Jobs submitted before shutdown are still converted.
+	    if (queue.empty()) break;
+	    entry = std::move(queue.front());
+	    queue.pop_front();
+	}
+	space_available.notify_one();
+
+	Result result;
+	if (!handle) {
+	    result.status = Result::INIT_FAILED;
+	    result.message = init_errmsg;
+	} else {
+	    const Job & job = entry.job;
+	    const char * format = job.format.empty() ? NULL : job.format.c_str();
+	    const char * options =
+		job.options.empty() ? NULL : job.options.c_str();
+	    switch (convert(handle, job.url,
+			    job.input.c_str(), job.output.c_str(),
+			    format, options, result.message)) {
+		case CONVERT_OK:
+		    result.status = Result::OK;
+		    break;
+		case CONVERT_NO_HANDLE:
+		    result.status = Result::INIT_FAILED;
+		    break;
+		case CONVERT_LOAD_FAILED:
+		    result.status = Result::LOAD_FAILED;
+		    break;
+		case CONVERT_EXPORT_FAILED:
+		    result.status = Result::EXPORT_FAILED;
+		    break;
+		case CONVERT_EXCEPTION:
+		    result.status = Result::EXCEPTION;
+		    break;
+		case CONVERT_NOT_SPREADSHEET:
+		    // Only convert_sheets() fails this way.
+		    result.status = Result::LOAD_FAILED;
+		    break;
+	    }
+	}
+	entry.result.set_value(std::move(result));
+    }
+
+    if (handle) convert_cleanup(handle);
+}
+
+Converter::Converter(size_t max_queued)
+    : internal(new Internal(max_queued))
+{
+    internal->worker = thread(&Internal::run, internal.get());
+}
+
+Converter::~Converter()
+{
+    if (!internal) return;
+    {
+	lock_guard<mutex> lock(internal->m);
+	internal->shutting_down = true;
+    }
+    internal->work_available.notify_one();
+    // Wake any submit() calls blocked on a full queue so they fail rather
+    // than waiting forever.
+    internal->space_available.notify_all();
+    internal->worker.join();
+}
+
+Converter::Converter(Converter && o) noexcept = default;
+
+Converter &
+Converter::operator=(Converter && o) noexcept
+{
+    if (this != &o) {
+	Converter tmp(std::move(*this));
+	internal = std::move(o.internal);
+    }
+    return *this;
+}
+
+future<Result>
+Converter::submit(Job job)
+{
+    promise<Result> result;
+    future<Result> f = result.get_future();
+    if (!internal) {
+	Result r;
+	r.status = Result::SHUT_DOWN;
+	r.message = "Converter has been moved from";
+	result.set_value(std::move(r));
+	return f;
+    }
+
+    {
+	unique_lock<mutex> lock(internal->m);
+	Internal & i = *internal;
+	i.space_available.wait(lock, [&i] {
+	    return i.queue.size() < i.max_queued || i.shutting_down;
+	});
+	if (i.shutting_down) {
+	    Result r;
+	    r.status = Result::SHUT_DOWN;
+	    r.message = "Converter is shutting down";
+	    result.set_value(std::move(r));
+	    return f;
+	}
+	i.queue.push_back(Internal::Entry{std::move(job), std::move(result)});
+    }
+    internal->work_available.notify_one();
+    return f;
+}
+
+}
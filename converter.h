@@ -0,0 +1,99 @@
+/* converter.h - Asynchronous document conversion for embedding lloconv
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_CONVERTER_H
+#define INCLUDED_CONVERTER_H
+
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <string>
+
+namespace lloconv {
+
+/// A document to convert.
+struct Job {
+    std::string input;
+
+    std::string output;
+
+    /// Output format - if empty it's determined by the extension of output.
+    std::string format;
+
+    std::string options;
+
+    /// Is input a URL rather than a path?
+    bool url = false;
+};
+
+/// The outcome of a Job.
+struct Result {
+    enum Status {
+	OK,
+	/// LibreOfficeKit couldn't be initialised.
+	INIT_FAILED,
+	/// LibreOfficeKit failed to load the input document.
+	LOAD_FAILED,
+	/// LibreOfficeKit failed to export the output document.
+	EXPORT_FAILED,
+	/// LibreOfficeKit threw an exception.
+	EXCEPTION,
+	/// The Converter was moved from or is being destroyed.
+	SHUT_DOWN
+    };
+
+    Status status = OK;
+
+    /// Description of the failure (empty if status is OK).
+    std::string message;
+
+    explicit operator bool() const { return status == OK; }
+};
+
+/** Convert documents using LibreOfficeKit on a dedicated thread.
+ *
+ *  LibreOfficeKit is initialised on the Converter's own thread and all
+ *  conversions happen on that thread, one at a time, so the caller's threads
+ *  can submit work without any locking of their own.
+ *
+ *  LibreOfficeKit can only be initialised once per process, so don't have
+ *  more than one Converter at a time.
+ */
+class Converter {
+    struct Internal;
+
+    std::unique_ptr<Internal> internal;
+
+  public:
+    /** Start the conversion thread.
+     *
+     *  @param max_queued  Maximum number of submitted jobs which haven't
+     *			   started yet - once reached, submit() blocks until
+     *			   there's space.
+     */
+    explicit Converter(size_t max_queued = 16);
+
+    /// Finish all submitted jobs, then shut down LibreOfficeKit.
+    ~Converter();
+
+    Converter(Converter && o) noexcept;
+
+    Converter & operator=(Converter && o) noexcept;
+
+    Converter(const Converter &) = delete;
+
+    Converter & operator=(const Converter &) = delete;
+
+    /// Queue job for conversion.
+    std::future<Result> submit(Job job);
+};
+
+}
+
+#endif
@@ -0,0 +1,172 @@
+/* fileutils.cc - Helpers for working with files and directories
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "fileutils.h"
+
+#include <cerrno>
+#include <climits>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_FS_H
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
+
+using namespace std;
+
+double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int64_t
+stat_mtime(const struct stat & sb)
+{
+    return int64_t(sb.st_mtim.tv_sec) * 1000000000 + sb.st_mtim.tv_nsec;
+}
+
+bool
+mkdir_p(const string & dir)
+{
+    if (mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST) return true;
+    if (errno != ENOENT) return false;
+    string::size_type slash = dir.rfind('/');
+    if (slash == string::npos || slash == 0) return false;
+    if (!mkdir_p(dir.substr(0, slash))) return false;
+    return mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST;
+}
+
+static bool
+copy_data(int in, int out)
+{
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) return true;
+#endif
+    char buf[65536];
+    while (true) {
+	ssize_t n = read(in, buf, sizeof(buf));
+	if (n == 0) return true;
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return false;
+	}
+	const char * p = buf;
+	while (n) {
+	    ssize_t w = write(out, p, n);
+	    if (w < 0) {
+		if (errno == EINTR) continue;
+		return false;
+	    }
+	    p += w;
+	    n -= w;
+	}
+    }
+}
+
+bool
+copy_file(const string & src, const string & dst)
+{
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    struct stat sb;
+    if (fstat(in, &sb) < 0) {
+	int saved_errno = errno;
+	close(in);
+	errno = saved_errno;
+	return false;
+    }
+    string tmp = dst + ".lloconv-tmp";
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		   sb.st_mode & 0777);
+    if (out < 0) {
+	int saved_errno = errno;
+	close(in);
+	errno = saved_errno;
+	return false;
+    }
+    bool ok = copy_data(in, out);
+    int saved_errno = errno;
+    close(in);
+    if (close(out) < 0 && ok) {
+	ok = false;
+	saved_errno = errno;
+    }
+    if (ok && rename(tmp.c_str(), dst.c_str()) < 0) {
+	ok = false;
+	saved_errno = errno;
+    }
+    if (!ok) {
+	unlink(tmp.c_str());
+	errno = saved_errno;
+    }
+    return ok;
+}
+
+bool
+copy_tree(const string & src, const string & dst)
+{
+    struct stat sb;
+    if (lstat(src.c_str(), &sb) < 0) return false;
+    if (S_ISLNK(sb.st_mode)) {
+	char target[PATH_MAX];
+	ssize_t len = readlink(src.c_str(), target, sizeof(target) - 1);
+	if (len < 0) return false;
+	target[len] = '\0';
+	return symlink(target, dst.c_str()) == 0;
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+	if (!copy_file(src, dst)) return false;
+	return (sb.st_mode & S_IWUSR) ||
+	       chmod(dst.c_str(), (sb.st_mode & 0777) | S_IWUSR) == 0;
+    }
+    if (mkdir(dst.c_str(), (sb.st_mode & 0777) | S_IRWXU) < 0) return false;
+    DIR * dir = opendir(src.c_str());
+    if (!dir) return false;
+    bool ok = true;
+    struct dirent * d;
+    while (ok && (d = readdir(dir))) {
+	const char * leaf = d->d_name;
+	if (is_dot_or_dotdot(leaf)) continue;
+	ok = copy_tree(src + '/' + leaf, dst + '/' + leaf);
+    }
+    int saved_errno = errno;
+    closedir(dir);
+    errno = saved_errno;
+    return ok;
+}
+
+bool
+remove_tree(const string & path)
+{
+    struct stat sb;
+    if (lstat(path.c_str(), &sb) < 0) return errno == ENOENT;
+    if (S_ISDIR(sb.st_mode)) {
+	DIR * dir = opendir(path.c_str());
+	if (!dir) return false;
+	struct dirent * d;
+	while ((d = readdir(dir))) {
+	    const char * leaf = d->d_name;
+	    if (is_dot_or_dotdot(leaf)) continue;
+	    remove_tree(path + '/' + leaf);
+	}
+	closedir(dir);
+	return rmdir(path.c_str()) == 0;
+    }
+    return unlink(path.c_str()) == 0;
+}
@@ -0,0 +1,50 @@
+/* fileutils.h - Helpers for working with files and directories
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_FILEUTILS_H
+#define INCLUDED_FILEUTILS_H
+
+#include <cstdint>
+#include <string>
+
+#include <sys/stat.h>
+
+// Seconds since an arbitrary point, from a clock which isn't affected by
+// changes to the system time, for measuring how long things take.
+double now();
+
+// Is name "." or ".." (which directory listings include, but which walks of
+// a directory tree need to skip)?
+inline bool
+is_dot_or_dotdot(const char * name)
+{
+    return name[0] == '.' &&
+	   (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Modification time in nanoseconds since the epoch.
+int64_t stat_mtime(const struct stat & sb);
+
+// Create directory dir, and any missing parent directories.
+bool mkdir_p(const std::string & dir);
+
+// Copy the file src to dst, replacing dst atomically if it exists.  Where the
+// filesystem supports it the copy shares src's data blocks (a "reflink") so
+// is almost free.  On failure errno is set.
+bool copy_file(const std::string & src, const std::string & dst);
+
+// Copy the directory src and everything in it to dst, which mustn't already
+// exist.  The copies are writable by us even if the originals aren't.  Files
+// are copied as copy_file() does.  On failure errno is set.
+bool copy_tree(const std::string & src, const std::string & dst);
+
+// Remove path, and everything in it if it's a directory.
+bool remove_tree(const std::string & path);
+
+#endif
@@ -0,0 +1,51 @@
+/* lloconv-test.cc - Checks for code which doesn't need LibreOffice to run
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include <iostream>
+#include <string>
+
+#include "convert.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void
+check_equal(const string & got, const string & want, const char * what)
+{
+    if (got != want) {
+	cerr << what << ": got '" << got << "', expected '" << want << "'\n";
+	++failures;
+    }
+}
+
+static void
+test_output_format()
+{
+    // A -z listener mustn't coalesce conversions to different formats which
+    // clients left LibreOfficeKit to pick from the output extension.
+    check_equal(convert_output_format("", "a.pdf"), "pdf", "extension");
+    check_equal(convert_output_format("", "b.html"), "html", "extension");
+    check_equal(convert_output_format("", "a.PDF"), "pdf", "case");
+    check_equal(convert_output_format("PDF", "b.html"), "pdf",
+		"explicit format");
+    check_equal(convert_output_format("", "dir.d/out"), "",
+		"no extension");
+    check_equal(convert_output_format("", "out"), "", "no extension");
+}
+
+int
+main(int, char ** argv)
+{
+    program = argv[0];
+    test_output_format();
+    return failures ? 1 : 0;
+}
@@ -9,21 +9,40 @@
 
 #include <config.h>
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <string>
+#include <vector>
 
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "archive.h"
+#include "budget.h"
 #include "convert.h"
+#include "fileutils.h"
+#include "manifest.h"
+#include "placement.h"
+#include "profile.h"
+#include "tree.h"
+#include "watch.h"
+#include "workers.h"
 
 using namespace std;
 
@@ -31,8 +50,53 @@ static void
 usage(ostream& os)
 {
     os << "Usage: " << program << " [-u|-s SOCKET_PATH] [-f OUTPUT_FORMAT] [-o OPTIONS] INPUT_FILE OUTPUT_FILE\n";
-    os << "       " << program << " -s SOCKET_PATH -l\n\n";
-    os << "  -u  INPUT_FILE is a URL\n\n";
+    os << "       " << program << " [-z [-j JOBS] [-M BUDGET] [-m LIMIT]|-C DOCS [--cache-memory SIZE]] [--idle-timeout SECONDS] [-v] -s SOCKET_PATH -l\n";
+    os << "       " << program << " --tree [-j JOBS] [-v] -f OUTPUT_FORMAT [-o OPTIONS] INPUT_DIR OUTPUT_DIR\n";
+    os << "       " << program << " --watch DIR --out OUTPUT_DIR [-v] -f OUTPUT_FORMAT [-o OPTIONS]\n";
+    os << "       " << program << " --sheets [-j JOBS] [-v] [-f OUTPUT_FORMAT] [-o OPTIONS] INPUT_FILE OUTPUT_FILE\n";
+    os << "       " << program << " --archive ARCHIVE [-j JOBS] [-v] -f OUTPUT_FORMAT [-o OPTIONS] INPUT_FILE...\n";
+    os << "       " << program << " --prepare-profile DIR [-v]\n\n";
+    os << "  -u  INPUT_FILE is a URL\n";
+    os << "  -z  listener forks a child from a preinitialised parent for each\n";
+    os << "      conversion, so each document is converted in isolation\n";
+    os << "  -j  maximum number of conversions a -z listener runs at once, or\n";
+    os << "      number of processes --tree, --archive or --sheets uses\n";
+    os << "      (default: number of CPUs)\n";
+    os << "  -M  limit on the total memory which a -z listener's conversions are\n";
+    os << "      expected to use - conversions wait until there's room, and\n";
+    os << "      any expected to need more than BUDGET fail (e.g. -M 8G)\n";
+    os << "  -m  limit on the extra address space each conversion by a -z\n";
+    os << "      listener can use (e.g. -m 2G)\n";
+    os << "  -C  number of loaded documents a listener without -z keeps, so\n";
+    os << "      converting an unchanged file again doesn't reload it\n";
+    os << "  --cache-memory  limit on the estimated memory used by documents\n";
+    os << "      kept by -C (default: 1G)\n";
+    os << "  --idle-timeout  listener exits after SECONDS without a request\n";
+    os << "      (with -s but not -l, applies to a listener started\n";
+    os << "      automatically)\n";
+    os << "  --tree  convert files under INPUT_DIR which have changed since the\n";
+    os << "      last run, to the same relative path under OUTPUT_DIR with\n";
+    os << "      .OUTPUT_FORMAT appended\n";
+    os << "  --watch  convert files in DIR to OUTPUT_DIR (with .OUTPUT_FORMAT\n";
+    os << "      appended) as they appear\n";
+    os << "  --sheets  export each sheet of the spreadsheet INPUT_FILE to\n";
+    os << "      OUTPUT_FILE with -N-SHEETNAME inserted before its extension,\n";
+    os << "      dividing the sheets between processes (for formats such as\n";
+    os << "      csv which export only the active sheet)\n";
+    os << "  --archive  write the conversions to a tar archive at ARCHIVE (- for\n";
+    os << "      stdout) as they finish, followed by an index of the results\n";
+    os << "  --profile  use the LibreOffice user profile in DIR (default: the\n";
+    os << "      LLOCONV_PROFILE environment variable, or a new one each time)\n";
+    os << "  --prepare-profile  set up DIR as a template profile for\n";
+    os << "      --profile, which each process uses a private copy of\n";
+    os << "  --cpus  run conversions only on the CPUs in LIST (e.g. 0-7,16-23),\n";
+    os << "      with memory on their NUMA nodes\n";
+    os << "  --pin  give each conversion process of --tree, --archive,\n";
+    os << "      --sheets or a -z listener its own share of the CPUs, and\n";
+    os << "      memory on their NUMA nodes\n";
+    os << "  --threads  limit the threads LibreOffice uses for parallel work\n";
+    os << "      within a conversion to N\n";
+    os << "  -v  report timings and CPU placement on stderr\n\n";
     os << "Known values for OUTPUT_FORMAT include:\n";
     os << "  For text documents: doc docx fodt html odt ott pdf txt xhtml\n\n";
     os << "Known OPTIONS include:\n";
@@ -44,11 +108,43 @@ usage(ostream& os)
     os << flush;
 }
 
+// Values for long options without a short equivalent.
+enum {
+    OPT_HELP = 256,
+    OPT_VERSION,
+    OPT_TREE,
+    OPT_WATCH,
+    OPT_OUT,
+    OPT_CACHE_MEMORY,
+    OPT_IDLE_TIMEOUT,
+    OPT_PROFILE,
+    OPT_PREPARE_PROFILE,
+    OPT_CPUS,
+    OPT_PIN,
+    OPT_THREADS,
+    OPT_ARCHIVE,
+    OPT_SHEETS
+};
+
 static const int LISTEN_BACKLOG = 64;
 
 // Automatically start a listener if -s is used there isn't one.
 static bool auto_listener = true;
 
+// How long to keep trying to connect to a listener we've just started, in
+// seconds.
+#define AUTO_LISTENER_TIMEOUT 10
+
+// Fork a child for each conversion in the listener (set by -z).
+static bool zygote = false;
+
+// Maximum number of concurrent conversions in a zygote listener (set by -j).
+// 0 means use the number of CPUs.
+static unsigned max_jobs = 0;
+
+// Report timings to stderr (set by -v).
+static bool verbose = false;
+
 static bool
 read_string(int fd, char ** s)
 {
@@ -129,14 +225,14 @@ write_string(int fd, const string & s)
     return write_all(fd, buf, buf_len) == 0 && write_all(fd, s.data(), len) == 0;
 }
 
-static void
+static bool
 read_params(int fd, char ** format, char ** input,
 	    char ** output, char ** options)
 {
-    read_string(fd, format);
-    read_string(fd, input);
-    read_string(fd, output);
-    read_string(fd, options);
+    return read_string(fd, format) &&
+	   read_string(fd, input) &&
+	   read_string(fd, output) &&
+	   read_string(fd, options);
 }
 
 static void
@@ -169,73 +265,641 @@ write_result(int fd, int v)
     write_string(fd, buf);
 }
 
+// A client waiting for the result of a conversion.
+struct daemon_client {
+    int fd;
+
+    string output;
+};
+
+// A conversion requested of the listener.
+struct daemon_job {
+    // Clients waiting for the result.  We convert to the first's output,
+    // then copy it for any others - these are requests for the same
+    // conversion which arrived while this one was queued or running.
+    vector<daemon_client> clients;
+
+    string format, input, output, options;
+
+    // Identity of the input when the request arrived, used to spot
+    // requests for the same conversion.  Only valid if have_identity.
+    bool have_identity;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;
+
+    // When the request was received.
+    double start;
+
+    // How long fork() took.
+    double fork_time;
+
+    // Type and size of the input, and the memory we expect converting it to
+    // need.
+    string type;
+    uint64_t size;
+    uint64_t estimate;
+
+    // Which of the max_jobs placement slots the child uses.
+    unsigned slot;
+};
+
+// Jobs waiting to start, in the order they were received.
+static deque<daemon_job> queued;
+
+// Jobs running in children of a zygote listener.
+static map<pid_t, daemon_job> running;
+
+// Limit on the total estimated memory use of running conversions (set by -M).
+// 0 means no limit.
+static uint64_t memory_budget = 0;
+
+// Sum of the estimates for running conversions.
+static uint64_t memory_committed = 0;
+
+// Limit on how much address space each conversion can use beyond what the
+// parent has (set by -m).  0 means no limit.
+static uint64_t job_memory_limit = 0;
+
+// Exit a listener after this many seconds without a request (set by
+// --idle-timeout).  0 means never.
+static unsigned idle_timeout = 0;
+
+// Maximum number of loaded documents a listener keeps (set by -C), and the
+// total memory they can use (set by --cache-memory).
+static size_t cache_max_docs = 0;
+static uint64_t cache_max_bytes = 1ULL << 30;
+
+// The resident size of the parent, which children share copy-on-write.
+static uint64_t zygote_rss = 0;
+
+static memory_model model;
+
+// Self-pipe used to wake up the daemon's main loop on SIGCHLD.
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void
+sigchld_handler(int)
+{
+    int saved_errno = errno;
+    if (write(sigchld_pipe[1], "", 1) < 0) {
+	// Pipe full, so the main loop will be woken anyway.
+    }
+    errno = saved_errno;
+}
+
+// Current size of our address space in bytes, or 0 if unknown.
+static uint64_t
+address_space_size()
+{
+    FILE * f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long pages = 0;
+    if (fscanf(f, "%lu", &pages) != 1) pages = 0;
+    fclose(f);
+    return uint64_t(pages) * sysconf(_SC_PAGESIZE);
+}
+
+// The lowest placement slot which no running job is using.
+static unsigned
+free_slot()
+{
+    vector<bool> used(max_jobs);
+    for (auto & i : running) {
+	if (i.second.slot < max_jobs) used[i.second.slot] = true;
+    }
+    unsigned slot = 0;
+    while (slot < max_jobs && used[slot]) ++slot;
+    return slot;
+}
+
+static bool
+start_zygote_job(int sock, const daemon_job & job)
+{
+    unsigned slot = free_slot();
+    double t = now();
+    pid_t child = fork();
+    if (child == -1) {
+	perror("fork");
+	return false;
+    }
+    if (child == 0) {
+	// The parent reports the result, so if we crash or get killed part way
+	// through the client still gets told.  Close the connections of every
+	// other job too, so that if the parent dies their clients see EOF
+	// rather than waiting for unrelated children to exit.  job is one of
+	// the queued jobs.
+	for (const daemon_job & other : queued) {
+	    for (const daemon_client & client : other.clients) {
+		close(client.fd);
+	    }
+	}
+	for (const auto & other : running) {
+	    for (const daemon_client & client : other.second.clients) {
+		close(client.fd);
+	    }
+	}
+	close(sock);
+	close(sigchld_pipe[0]);
+	close(sigchld_pipe[1]);
+	signal(SIGCHLD, SIG_DFL);
+	if (job_memory_limit) {
+	    // Address space already mapped by the parent (much of it shared)
+	    // doesn't count towards the limit.
+	    struct rlimit rl;
+	    rl.rlim_cur = rl.rlim_max = address_space_size() + job_memory_limit;
+	    if (setrlimit(RLIMIT_AS, &rl) < 0) {
+		perror("setrlimit");
+	    }
+	}
+	placement_apply(slot);
+	void * handle = convert_init();
+	if (!handle) {
+	    _Exit(EX_UNAVAILABLE);
+	}
+	const char * format = job.format.empty() ? NULL : job.format.c_str();
+	const char * options = job.options.empty() ? NULL : job.options.c_str();
+	// Avoid segfault from LibreOffice by terminating swiftly.
+	_Exit(convert(handle, false, job.input.c_str(), job.output.c_str(),
+		      format, options));
+    }
+    daemon_job & r = running[child] = job;
+    r.fork_time = now() - t;
+    r.slot = slot;
+    memory_committed += job.estimate;
+    return true;
+}
+
+static void
+finish_job(const daemon_job & job, int res)
+{
+    // Make all the copies before replying to anyone, as once the first
+    // client has the result it might move or modify its output.
+    vector<int> results(job.clients.size(), res);
+    for (size_t i = 1; i < job.clients.size(); ++i) {
+	const string & output = job.clients[i].output;
+	if (res != 0 || output == job.output) continue;
+	if (!copy_file(job.output, output)) {
+	    cerr << program << ": Failed to copy '" << job.output << "' to '"
+		 << output << "' (" << strerror(errno) << ")\n";
+	    results[i] = 1;
+	}
+    }
+    for (size_t i = 0; i != job.clients.size(); ++i) {
+	write_result(job.clients[i].fd, results[i]);
+	close(job.clients[i].fd);
+    }
+}
+
+// Clients usually leave the format for LibreOfficeKit to pick from the output
+// extension, so compare the format each would actually get.
+static bool
+same_conversion(const daemon_job & a, const daemon_job & b)
+{
+    string format = convert_output_format(a.format, a.output);
+    return a.have_identity && b.have_identity && !format.empty() &&
+	   a.dev == b.dev && a.ino == b.ino &&
+	   a.mtime == b.mtime && a.size == b.size &&
+	   a.options == b.options &&
+	   format == convert_output_format(b.format, b.output);
+}
+
+// If the same conversion is already queued or running, add job's client to
+// it and return true.
+static bool
+coalesce_job(const daemon_job & job)
+{
+    daemon_job * match = NULL;
+    for (daemon_job & other : queued) {
+	if (same_conversion(job, other)) {
+	    match = &other;
+	    break;
+	}
+    }
+    if (!match) {
+	for (auto & other : running) {
+	    if (same_conversion(job, other.second)) {
+		match = &other.second;
+		break;
+	    }
+	}
+    }
+    if (!match) return false;
+    match->clients.push_back(job.clients[0]);
+    if (verbose) {
+	cerr << program << ": request to convert '" << job.input << "' "
+		"joined one already in progress\n";
+    }
+    return true;
+}
+
+// Start queued jobs in order for as long as we have the capacity.
+static void
+start_zygote_jobs(int sock)
+{
+    while (!queued.empty() && running.size() < max_jobs) {
+	daemon_job & job = queued.front();
+	// If nothing is running then start the job regardless, as otherwise
+	// it'd never start.  Jobs bigger than the whole budget are rejected
+	// before being queued, so this only happens if the estimates have
+	// changed since.
+	if (memory_budget && !running.empty() &&
+	    memory_committed + job.estimate > memory_budget) {
+	    break;
+	}
+	if (!start_zygote_job(sock, job)) {
+	    finish_job(job, 1);
+	}
+	queued.pop_front();
+    }
+}
+
+static void
+queue_job(const char * format, const char * input,
+	  const char * output, const char * options, int fd)
+{
+    daemon_job job;
+    daemon_client client;
+    client.fd = fd;
+    client.output = output;
+    job.clients.push_back(client);
+    job.format = format;
+    job.input = input;
+    job.output = output;
+    job.options = options;
+    job.start = now();
+    struct stat sb;
+    job.have_identity = stat(input, &sb) == 0;
+    if (job.have_identity) {
+	job.dev = sb.st_dev;
+	job.ino = sb.st_ino;
+	job.mtime = stat_mtime(sb);
+	job.size = sb.st_size;
+    } else {
+	job.size = 0;
+    }
+    if (coalesce_job(job)) {
+	return;
+    }
+    job.type = memory_model::file_type(job.input);
+    job.estimate = model.estimate(job.type, job.size);
+    if (memory_budget && job.estimate > memory_budget) {
+	cerr << program << ": Rejecting '" << job.input << "' which is "
+		"expected to need " << (job.estimate >> 20) << "MB\n";
+	finish_job(job, EX_UNAVAILABLE);
+	return;
+    }
+    queued.push_back(job);
+}
+
+// Convert the first queued job in this process.
+static void
+run_inline_job(void * handle)
+{
+    daemon_job job = queued.front();
+    queued.pop_front();
+    const char * format = job.format.empty() ? NULL : job.format.c_str();
+    const char * options = job.options.empty() ? NULL : job.options.c_str();
+    // Hard-code that the path is a file not a URL when using a server, at
+    // least for now.
+    int res = convert(handle, false, job.input.c_str(), job.output.c_str(),
+		      format, options);
+    finish_job(job, res);
+    if (verbose) {
+	cerr << program << ": converted '" << job.input << "' (job "
+	     << (now() - job.start) * 1e3 << "ms)\n";
+	if (cache_max_docs) {
+	    convert_cache_stats stats = convert_get_cache_stats();
+	    cerr << program << ": document cache: " << stats.hits
+		 << " hits, " << stats.misses << " misses, "
+		 << stats.evictions << " evictions, "
+		 << stats.load_time_saved * 1e3 << "ms of loading saved\n";
+	}
+    }
+}
+
+static void
+reap_zygote_jobs()
+{
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) { }
+
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+	map<pid_t, daemon_job>::iterator i = running.find(pid);
+	if (i == running.end()) continue;
+	const daemon_job & job = i->second;
+	int res;
+	if (WIFEXITED(status)) {
+	    res = WEXITSTATUS(status);
+	} else {
+	    res = 1;
+	    cerr << program << ": converting '" << job.input << "' killed by "
+		    "signal " << WTERMSIG(status) << "\n";
+	}
+	finish_job(job, res);
+	memory_committed -= job.estimate;
+	// ru_maxrss is in KB and includes pages shared with the parent.
+	uint64_t rss = uint64_t(ru.ru_maxrss) << 10;
+	uint64_t used = rss > zygote_rss ? rss - zygote_rss : 0;
+	if (res == 0) {
+	    model.observe(job.type, job.size, used);
+	}
+	if (verbose) {
+	    cerr << program << ": converted '" << job.input << "' (fork "
+		 << job.fork_time * 1e3 << "ms, job "
+		 << (now() - job.start) * 1e3 << "ms, memory "
+		 << (used >> 20) << "MB, estimated "
+		 << (job.estimate >> 20) << "MB)\n";
+	}
+	running.erase(i);
+    }
+}
+
+// If a supervisor (such as systemd) started us and passed a listening socket
+// using the LISTEN_FDS convention, return it, otherwise -1.
+static int
+inherited_listener()
+{
+    const char * pid = getenv("LISTEN_PID");
+    const char * fds = getenv("LISTEN_FDS");
+    if (!pid || !fds || atol(pid) != long(getpid()) || atoi(fds) < 1) {
+	return -1;
+    }
+    // Don't pass these on to any children.
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    // The sockets are passed starting at fd 3.  We only use the first.
+    fcntl(3, F_SETFD, FD_CLOEXEC);
+    return 3;
+}
+
 static int
 llo_daemon(const char * socket_path)
 try {
-    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock < 0) {
-	perror("socket");
-	return 1;
-    }
+    int sock = inherited_listener();
+    // If the socket was passed to us then the supervisor keeps it open
+    // while we're not running, so connections made then will be waiting
+    // for the next instance.
+    bool activated = sock >= 0;
+    if (!activated) {
+	if (!socket_path) {
+	    cerr << program << ": No socket path specified and no socket "
+		    "passed via LISTEN_FDS\n";
+	    return EX_USAGE;
+	}
 
-    struct sockaddr_un my_addr;
-    memset(&my_addr, 0, sizeof(struct sockaddr_un));
-    my_addr.sun_family = AF_UNIX;
-    if (strlen(socket_path) >= sizeof(my_addr.sun_path)) {
-	fprintf(stderr, "socket path too long\n");
-	return 1;
-    }
-    strcpy(my_addr.sun_path, socket_path);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+	    perror("socket");
+	    return 1;
+	}
 
-    if (bind(sock, (struct sockaddr *)&my_addr, sizeof(my_addr)) < 0) {
-	perror("bind");
-	return 1;
+	struct sockaddr_un my_addr;
+	memset(&my_addr, 0, sizeof(struct sockaddr_un));
+	my_addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(my_addr.sun_path)) {
+	    fprintf(stderr, "socket path too long\n");
+	    return 1;
+	}
+	strcpy(my_addr.sun_path, socket_path);
+
+	if (bind(sock, (struct sockaddr *)&my_addr, sizeof(my_addr)) < 0) {
+	    perror("bind");
+	    return 1;
+	}
+
+	// Listen before initialising LibreOffice so clients can connect and
+	// wait in the backlog meanwhile.
+	if (listen(sock, LISTEN_BACKLOG) < 0) {
+	    perror("listen");
+	    return 1;
+	}
     }
 
-    void * handle = convert_init();
-    if (!handle) {
-	return EX_UNAVAILABLE;
+    // Don't get killed if a client goes away before we reply.
+    signal(SIGPIPE, SIG_IGN);
+
+    void * handle = NULL;
+    if (zygote) {
+	// LibreOfficeKit starts threads during full initialisation and those
+	// don't survive fork(), so we only preinitialise here and each child
+	// completes initialisation for itself.
+	double t = now();
+	if (!convert_preinit()) {
+	    cerr << program << ": Failed to preinitialise LibreOfficeKit - "
+		    "each conversion will fully initialise it\n";
+	} else if (verbose) {
+	    cerr << program << ": preinitialised LibreOfficeKit in "
+		 << (now() - t) * 1e3 << "ms\n";
+	}
+	if (pipe(sigchld_pipe) < 0) {
+	    perror("pipe");
+	    return 1;
+	}
+	for (int i = 0; i < 2; ++i) {
+	    fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+	    fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+	if (max_jobs == 0) {
+	    max_jobs = default_worker_count();
+	}
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+	    zygote_rss = uint64_t(ru.ru_maxrss) << 10;
+	}
+    } else {
+	double t = now();
+	handle = convert_init();
+	if (!handle) {
+	    return EX_UNAVAILABLE;
+	}
+	if (verbose) {
+	    cerr << program << ": initialised LibreOfficeKit in "
+		 << (now() - t) * 1e3 << "ms\n";
+	}
+	convert_set_cache(cache_max_docs, cache_max_bytes);
     }
+
     char * format = NULL;
     char * input = NULL;
     char * output = NULL;
     char * options = NULL;
 
+    double last_activity = now();
+    // Set once we've timed out and removed our socket.
+    bool draining = false;
+
     while (true) {
-	if (listen(sock, LISTEN_BACKLOG) < 0) {
-	    perror("listen");
+	if (zygote) {
+	    start_zygote_jobs(sock);
+	}
+	// When converting in this process, accept any connections which are
+	// waiting before starting the next conversion, so that requests for
+	// the same conversion can be coalesced.
+	bool busy = !zygote && !queued.empty();
+	int timeout = busy ? 0 : -1;
+	if (idle_timeout && !busy && queued.empty() && running.empty()) {
+	    double left = last_activity + idle_timeout - now();
+	    if (draining || left <= 0) {
+		if (activated) break;
+		if (!draining) {
+		    // Stop new clients finding us, so they'll start a new
+		    // listener instead, then handle any which already have.
+		    unlink(socket_path);
+		    draining = true;
+		}
+		timeout = 0;
+	    } else {
+		timeout = int(left * 1000) + 1;
+	    }
+	}
+	struct pollfd fds[2];
+	// Once enough jobs are waiting, leave new connections in the listen
+	// backlog.
+	fds[0].fd = queued.size() < LISTEN_BACKLOG ? sock : -1;
+	fds[0].events = POLLIN;
+	fds[1].fd = sigchld_pipe[0];
+	fds[1].events = POLLIN;
+	int r = poll(fds, 2, timeout);
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    perror("poll");
 	    return 1;
 	}
+	if (r == 0 && draining && queued.empty() && running.empty()) {
+	    break;
+	}
+	if (r > 0 || busy) {
+	    last_activity = now();
+	}
+	if (fds[1].revents) {
+	    reap_zygote_jobs();
+	}
+	if (!fds[0].revents) {
+	    if (busy) {
+		run_inline_job(handle);
+	    }
+	    continue;
+	}
 
 	struct sockaddr_un peer_addr;
 	socklen_t peer_addr_size = sizeof(struct sockaddr_un);
 	int fd = accept(sock, (struct sockaddr *) &peer_addr, &peer_addr_size);
 	if (fd < 0) {
+	    if (errno == EINTR) continue;
 	    perror("accept");
 	    return 1;
 	}
 
-	read_params(fd, &format, &input, &output, &options);
-	if (!format[0]) {
-	    free(format);
-	    format = NULL;
+	if (!read_params(fd, &format, &input, &output, &options)) {
+	    close(fd);
+	    continue;
 	}
-	if (!options[0]) {
-	    free(options);
-	    options = NULL;
-	}
-	// Hard-code that the path is a file not a URL when using a server, at
-	// least for now.
-	int res = convert(handle, false, input, output, format, options);
-	write_result(fd, res);
-	close(fd);
+	queue_job(format, input, output, options, fd);
     }
-    convert_cleanup(handle);
+
+    if (verbose) {
+	cerr << program << ": exiting after " << idle_timeout
+	     << " seconds idle\n";
+    }
+    // We don't call convert_cleanup() as our caller uses _Exit() to avoid
+    // a segfault from LibreOffice, and removes any copy of a template
+    // profile itself.
+    return 0;
 } catch (const exception & e) {
     cerr << program << ": LibreOffice threw exception (" << e.what() << ")\n";
     return 1;
 }
 
+// Export the sheets of a spreadsheet to separate files, with each of up to
+// jobs processes loading the document and exporting its share of the sheets.
+static int
+convert_each_sheet(const char * input, const char * output,
+		   const char * format, const char * options, unsigned jobs)
+{
+    double t = now();
+    if (jobs > 1) {
+	// A large workbook can need gigabytes of memory to load, so first
+	// count the sheets to avoid having more processes load it than there
+	// are sheets to share between them.  This has to happen in a worker
+	// as LibreOfficeKit's threads wouldn't survive us forking afterwards.
+	int fds[2];
+	if (pipe(fds) < 0) {
+	    perror("pipe");
+	    return 1;
+	}
+	bool counted = false;
+	run_workers(1, 1,
+		    [&](void * handle, size_t) -> int {
+			int nsheets;
+			string errmsg;
+			if (convert_count_sheets(handle, input, options,
+						 nsheets, errmsg) != CONVERT_OK) {
+			    cerr << program << ": " << errmsg << '\n';
+			    return 1;
+			}
+			ssize_t n = write(fds[1], &nsheets, sizeof(nsheets));
+			return n == sizeof(nsheets) ? 0 : 1;
+		    },
+		    [&](size_t, int status) {
+			counted = (status == 0);
+		    });
+	int nsheets = 0;
+	if (counted &&
+	    read(fds[0], &nsheets, sizeof(nsheets)) != sizeof(nsheets)) {
+	    counted = false;
+	}
+	close(fds[0]);
+	close(fds[1]);
+	if (!counted) {
+	    return 1;
+	}
+	if (verbose) {
+	    cerr << program << ": counted " << nsheets << " sheets in "
+		 << (now() - t) * 1e3 << "ms\n";
+	}
+	if (nsheets == 0) {
+	    return 0;
+	}
+	jobs = min(jobs, unsigned(nsheets));
+    }
+
+    bool failed = false;
+    run_workers(jobs, jobs,
+		[&](void * handle, size_t share) -> int {
+		    int nsheets;
+		    string errmsg;
+		    convert_status status =
+			convert_sheets(handle, input, output, format, options,
+				       share, jobs, nsheets, errmsg);
+		    // Every process fails to load the document in the same
+		    // way, so only report that once.
+		    if (status == CONVERT_EXPORT_FAILED ||
+			(status != CONVERT_OK && share == 0)) {
+			cerr << program << ": " << errmsg << '\n';
+		    }
+		    return status == CONVERT_OK ? 0 : 1;
+		},
+		[&](size_t, int status) {
+		    if (status != 0) failed = true;
+		});
+    if (verbose) {
+	cerr << program << ": exported sheets using " << jobs
+	     << (jobs == 1 ? " process" : " processes") << " in "
+	     << (now() - t) * 1e3 << "ms\n";
+    }
+    return failed ? 1 : 0;
+}
+
 static int
 llo_daemon_convert(int fd, const char * format, const char * input,
 		   const char * output, const char * options)
@@ -255,94 +919,248 @@ main(int argc, char **argv)
     bool listener = false;
     const char * socket_path = NULL;
 
-    // FIXME: Use getopt() or something.
-    ++argv;
-    --argc;
-    while (argv[0] && argv[0][0] == '-') {
-	switch (argv[0][1]) {
-	    case '-':
-		if (argv[0][2] == '\0') {
-		    // End of options.
-		    ++argv;
-		    --argc;
-		    goto last_option;
-		}
-		if (strcmp(argv[0] + 2, "help") == 0) {
-		    usage(cout);
-		    exit(0);
-		}
-		if (strcmp(argv[0] + 2, "version") == 0) {
-		    cout << "lloconv - " PACKAGE_STRING "\n";
-		    exit(0);
+    bool tree = false;
+    const char * watch_dir = NULL;
+    const char * out_dir = NULL;
+    const char * prepare_profile = NULL;
+    const char * cpus = NULL;
+    bool pin = false;
+    bool cache_memory_set = false;
+    const char * archive = NULL;
+    bool sheets = false;
+
+    static const struct option long_opts[] = {
+	{ "help", no_argument, NULL, OPT_HELP },
+	{ "version", no_argument, NULL, OPT_VERSION },
+	{ "tree", no_argument, NULL, OPT_TREE },
+	{ "watch", required_argument, NULL, OPT_WATCH },
+	{ "out", required_argument, NULL, OPT_OUT },
+	{ "cache-memory", required_argument, NULL, OPT_CACHE_MEMORY },
+	{ "idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT },
+	{ "profile", required_argument, NULL, OPT_PROFILE },
+	{ "prepare-profile", required_argument, NULL, OPT_PREPARE_PROFILE },
+	{ "cpus", required_argument, NULL, OPT_CPUS },
+	{ "pin", no_argument, NULL, OPT_PIN },
+	{ "threads", required_argument, NULL, OPT_THREADS },
+	{ "archive", required_argument, NULL, OPT_ARCHIVE },
+	{ "sheets", no_argument, NULL, OPT_SHEETS },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "f:o:uls:zj:M:m:C:v", long_opts, NULL)) != -1) {
+	switch (c) {
+	    case OPT_HELP:
+		usage(cout);
+		exit(0);
+	    case OPT_VERSION:
+		cout << "lloconv - " PACKAGE_STRING "\n";
+		exit(0);
+	    case OPT_TREE:
+		tree = true;
+		break;
+	    case OPT_WATCH:
+		watch_dir = optarg;
+		break;
+	    case OPT_OUT:
+		out_dir = optarg;
+		break;
+	    case OPT_PROFILE:
+		convert_set_profile(optarg);
+		break;
+	    case OPT_PREPARE_PROFILE:
+		prepare_profile = optarg;
+		break;
+	    case OPT_CPUS:
+		cpus = optarg;
+		break;
+	    case OPT_PIN:
+		pin = true;
+		break;
+	    case OPT_ARCHIVE:
+		archive = optarg;
+		break;
+	    case OPT_SHEETS:
+		sheets = true;
+		break;
+	    case OPT_THREADS:
+		if (atoi(optarg) <= 0) {
+		    cerr << "Option --threads needs a positive number\n\n";
+		    usage(cerr);
+		    _Exit(EX_USAGE);
 		}
+		// LibreOffice sizes its thread pool from this.
+		setenv("MAX_CONCURRENCY", optarg, 1);
 		break;
 	    case 'f':
-		if (argv[0][2]) {
-		    format = argv[0] + 2;
-		    ++argv;
-		    --argc;
-		} else {
-		    format = argv[1];
-		    argv += 2;
-		    argc -= 2;
-		}
-		continue;
+		format = optarg;
+		break;
 	    case 'o':
-		if (argv[0][2]) {
-		    options = argv[0] + 2;
-		    ++argv;
-		    --argc;
-		} else {
-		    options = argv[1];
-		    argv += 2;
-		    argc -= 2;
-		}
-		continue;
+		options = optarg;
+		break;
 	    case 'u':
-		if (argv[0][2] != '\0') {
-		    break;
-		}
 		url = true;
-		++argv;
-		--argc;
-		continue;
+		break;
 	    case 'l':
-		if (argv[0][2] != '\0') {
-		    break;
-		}
 		listener = true;
-		++argv;
-		--argc;
-		continue;
-	    case 's':
-		if (argv[0][2]) {
-		    socket_path = argv[0] + 2;
-		    ++argv;
-		    --argc;
+		break;
+	    case 'z':
+		zygote = true;
+		break;
+	    case 'v':
+		verbose = true;
+		break;
+	    case 'j':
+		if (atoi(optarg) <= 0) {
+		    cerr << "Option -j needs a positive number\n\n";
+		    usage(cerr);
+		    _Exit(EX_USAGE);
+		}
+		max_jobs = atoi(optarg);
+		break;
+	    case OPT_IDLE_TIMEOUT:
+		if (atoi(optarg) <= 0) {
+		    cerr << "Option --idle-timeout needs a positive number\n\n";
+		    usage(cerr);
+		    _Exit(EX_USAGE);
+		}
+		idle_timeout = atoi(optarg);
+		break;
+	    case 'C':
+		if (atoi(optarg) <= 0) {
+		    cerr << "Option -C needs a positive number\n\n";
+		    usage(cerr);
+		    _Exit(EX_USAGE);
+		}
+		cache_max_docs = atoi(optarg);
+		break;
+	    case 'M':
+	    case 'm':
+	    case OPT_CACHE_MEMORY: {
+		uint64_t size = parse_size(optarg);
+		if (!size) {
+		    cerr << "Option "
+			 << (c == OPT_CACHE_MEMORY ? "--cache-memory" :
+			     c == 'M' ? "-M" : "-m")
+			 << " needs a size such as 512M or 4G\n\n";
+		    usage(cerr);
+		    _Exit(EX_USAGE);
+		}
+		if (c == 'M') {
+		    memory_budget = size;
+		} else if (c == 'm') {
+		    job_memory_limit = size;
 		} else {
-		    socket_path = argv[1];
-		    argv += 2;
-		    argc -= 2;
+		    cache_max_bytes = size;
+		    cache_memory_set = true;
 		}
-		continue;
+		break;
+	    }
+	    case 's':
+		socket_path = optarg;
+		break;
+	    default:
+		cerr << '\n';
+		usage(cerr);
+		_Exit(EX_USAGE);
+	}
+    }
+    argv += optind;
+    argc -= optind;
+
+    if ((memory_budget || job_memory_limit) && !zygote) {
+	usage(cerr);
+	_Exit(EX_USAGE);
+    }
+
+    // Only a listener keeps documents loaded, but not with -z as its
+    // children exit after each conversion.  With -s but not -l these apply
+    // to a listener started automatically.
+    if ((cache_max_docs || cache_memory_set) &&
+	(zygote || !(listener || socket_path))) {
+	usage(cerr);
+	_Exit(EX_USAGE);
+    }
+
+    if (cpus || pin) {
+	// Each worker of --tree, --archive or --sheets and each child of a -z
+	// listener has a slot.
+	unsigned nslots = 1;
+	if (tree || archive || sheets || zygote) {
+	    nslots = max_jobs ? max_jobs : default_worker_count();
+	}
+	if (!placement_setup(cpus, pin, nslots)) {
+	    _Exit(EX_USAGE);
+	}
+	if (verbose) {
+	    placement_report(cerr);
 	}
+    }
 
-	cerr << "Option '" << argv[0] << "' unknown\n\n";
-	argc = -1;
-	break;
+    if (prepare_profile) {
+	if (argc != 0 || tree || archive || sheets || watch_dir || out_dir ||
+	    listener || socket_path) {
+	    usage(cerr);
+	    _Exit(EX_USAGE);
+	}
+	// Avoid segfault from LibreOffice by terminating swiftly.
+	_Exit(convert_prepare_profile(prepare_profile, verbose));
+    }
+
+    if (archive) {
+	if (argc == 0 || !format || url || listener || socket_path || zygote ||
+	    tree || sheets || watch_dir || out_dir) {
+	    usage(cerr);
+	    _Exit(EX_USAGE);
+	}
+	vector<string> inputs(argv, argv + argc);
+	unsigned jobs = max_jobs ? max_jobs : default_worker_count();
+	_Exit(convert_archive(inputs, archive, format, options, jobs, verbose));
+    }
+
+    if (sheets) {
+	if (argc != 2 || url || listener || socket_path || zygote || tree ||
+	    watch_dir || out_dir) {
+	    usage(cerr);
+	    _Exit(EX_USAGE);
+	}
+	unsigned jobs = max_jobs ? max_jobs : default_worker_count();
+	_Exit(convert_each_sheet(argv[0], argv[1], format, options, jobs));
+    }
+
+    if (tree) {
+	if (argc != 2 || !format || url || listener || socket_path || zygote) {
+	    usage(cerr);
+	    _Exit(EX_USAGE);
+	}
+	unsigned jobs = max_jobs ? max_jobs : default_worker_count();
+	_Exit(convert_tree(argv[0], argv[1], format, options, jobs, verbose));
+    }
+
+    if (watch_dir || out_dir) {
+	if (argc != 0 || !watch_dir || !out_dir || !format || url ||
+	    listener || socket_path || zygote) {
+	    usage(cerr);
+	    _Exit(EX_USAGE);
+	}
+	int rc = convert_watch(watch_dir, out_dir, format, options, verbose);
+	convert_discard_profile();
+	_Exit(rc);
     }
-last_option:
 
     if (listener) {
-	if (argc != 0 || format || options || url || !socket_path) {
+	if (argc != 0 || format || options || url ||
+	    (!socket_path && !getenv("LISTEN_FDS"))) {
 	    usage(cerr);
 	    _Exit(EX_USAGE);
 	}
 
-	_Exit(llo_daemon(socket_path));
+	int rc = llo_daemon(socket_path);
+	convert_discard_profile();
+	_Exit(rc);
     }
 
-    if ((url && socket_path) || argc != 2) {
+    if ((url && socket_path) || (zygote && !socket_path) || argc != 2) {
 	usage(cerr);
 	_Exit(EX_USAGE);
     }
@@ -379,13 +1197,32 @@ last_option:
 		_Exit(1);
 	    }
 	    if (child == 0) {
-		_Exit(llo_daemon(socket_path));
+		int rc = llo_daemon(socket_path);
+		convert_discard_profile();
+		_Exit(rc);
 	    }
-	    // FIXME: Actually wait for daemon to start.
-	    sleep(1);
-	    if (connect(fd, (struct sockaddr *)&my_addr, sizeof(my_addr)) < 0) {
-		perror("connect");
-		_Exit(1);
+	    // The listener listens before initialising LibreOffice, so we can
+	    // connect as soon as it's got that far, and then wait in its
+	    // backlog.
+	    double deadline = now() + AUTO_LISTENER_TIMEOUT;
+	    useconds_t delay = 1000;
+	    while (true) {
+		close(fd);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+		    perror("socket");
+		    _Exit(1);
+		}
+		if (connect(fd, (struct sockaddr *)&my_addr, sizeof(my_addr)) == 0) {
+		    break;
+		}
+		if ((errno != ECONNREFUSED && errno != ENOENT) ||
+		    now() > deadline) {
+		    perror("connect");
+		    _Exit(1);
+		}
+		usleep(delay);
+		if (delay < 100000) delay *= 2;
 	    }
 	}
 
@@ -393,10 +1230,15 @@ last_option:
 	_Exit(rc);
     }
 
+    double t = now();
     void * handle = convert_init();
     if (!handle) {
 	_Exit(EX_UNAVAILABLE);
     }
+    if (verbose) {
+	cerr << program << ": initialised LibreOfficeKit in "
+	     << (now() - t) * 1e3 << "ms\n";
+    }
     int rc = convert(handle, url, input, output, format, options);
     convert_cleanup(handle);
 
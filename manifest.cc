@@ -0,0 +1,184 @@
+/* manifest.cc - Record of which input files have been converted
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "manifest.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "convert.h"
+
+using namespace std;
+
+// The first line of a manifest file.
+#define MANIFEST_MAGIC "lloconv manifest 1"
+
+// Paths and options can contain any byte, so escape the ones which would
+// confuse the line-based format.
+static void
+write_escaped(FILE * f, const string & s)
+{
+    for (char ch : s) {
+	switch (ch) {
+	    case '\\':
+		fputs("\\\\", f);
+		break;
+	    case '\n':
+		fputs("\\n", f);
+		break;
+	    default:
+		putc(ch, f);
+	}
+    }
+    putc('\n', f);
+}
+
+static void
+unescape(string & s, const char * p, const char * end)
+{
+    s.resize(0);
+    while (p != end) {
+	char ch = *p++;
+	if (ch == '\\' && p != end) {
+	    ch = *p++;
+	    if (ch == 'n') ch = '\n';
+	}
+	s += ch;
+    }
+}
+
+bool
+manifest::load(const string & path)
+{
+    entries.clear();
+    FILE * f = fopen(path.c_str(), "r");
+    if (!f) {
+	return errno == ENOENT;
+    }
+
+    char * line = NULL;
+    size_t len = 0;
+    ssize_t c;
+    bool ok = false;
+    string key;
+    // Header lines are the magic, the format and the options.
+    int header = 0;
+    while ((c = getline(&line, &len, f)) > 0) {
+	const char * end = line + c;
+	if (end[-1] == '\n') --end;
+	switch (header) {
+	    case 0:
+		if (size_t(end - line) != strlen(MANIFEST_MAGIC) ||
+		    memcmp(line, MANIFEST_MAGIC, end - line) != 0) {
+		    goto done;
+		}
+		++header;
+		continue;
+	    case 1:
+		unescape(format, line, end);
+		++header;
+		continue;
+	    case 2:
+		unescape(options, line, end);
+		++header;
+		ok = true;
+		continue;
+	}
+
+	// SIZE MTIME HASH PATH
+	manifest_entry e;
+	char * p;
+	e.size = strtoull(line, &p, 10);
+	if (*p++ != ' ') goto bad;
+	e.mtime = strtoll(p, &p, 10);
+	if (*p++ != ' ') goto bad;
+	e.hash = strtoull(p, &p, 16);
+	if (*p++ != ' ') goto bad;
+	unescape(key, p, end);
+	entries[key] = e;
+    }
+    goto done;
+
+bad:
+    ok = false;
+done:
+    free(line);
+    fclose(f);
+    if (!ok) {
+	cerr << program << ": " << path << ": Not a valid manifest\n";
+    }
+    return ok;
+}
+
+bool
+manifest::save(const string & path) const
+{
+    string tmp = path + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "w");
+    if (!f) {
+	cerr << program << ": " << tmp << ": " << strerror(errno) << '\n';
+	return false;
+    }
+    fputs(MANIFEST_MAGIC "\n", f);
+    write_escaped(f, format);
+    write_escaped(f, options);
+    for (const auto & i : entries) {
+	const manifest_entry & e = i.second;
+	fprintf(f, "%" PRIu64 " %" PRId64 " %" PRIx64 " ",
+		e.size, e.mtime, e.hash);
+	write_escaped(f, i.first);
+    }
+    // Make sure the contents are on disk before the rename() makes them
+    // visible, or a crash could leave us with an empty manifest.
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+	cerr << program << ": " << path << ": " << strerror(errno) << '\n';
+	unlink(tmp.c_str());
+	return false;
+    }
+    return true;
+}
+
+bool
+hash_file(const string & path, uint64_t & hash)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    // 64-bit FNV-1a.  This only needs to notice when a file has changed, not
+    // stand up to someone trying to make two files collide.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    close(fd);
+	    return false;
+	}
+	for (ssize_t i = 0; i != n; ++i) {
+	    h = (h ^ buf[i]) * 0x100000001b3ULL;
+	}
+    }
+    close(fd);
+    hash = h;
+    return true;
+}
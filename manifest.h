@@ -0,0 +1,45 @@
+/* manifest.h - Record of which input files have been converted
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_MANIFEST_H
+#define INCLUDED_MANIFEST_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+// What we knew about an input file when we last converted it.
+struct manifest_entry {
+    uint64_t size = 0;
+
+    // Modification time in nanoseconds since the epoch.
+    int64_t mtime = 0;
+
+    // Hash of the file's contents.
+    uint64_t hash = 0;
+};
+
+// Manifest entries keyed by path relative to the directory being converted.
+struct manifest {
+    // The output format and options the entries were converted with.
+    std::string format, options;
+
+    std::map<std::string, manifest_entry> entries;
+
+    // Load from path.  A missing file gives an empty manifest.
+    bool load(const std::string & path);
+
+    // Atomically replace path.
+    bool save(const std::string & path) const;
+};
+
+// Hash the contents of the file at path.
+bool hash_file(const std::string & path, uint64_t & hash);
+
+#endif
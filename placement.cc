@@ -0,0 +1,261 @@
+/* placement.cc - Place conversion processes on CPUs and NUMA nodes
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "placement.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_MEMPOLICY_H
+# include <sys/syscall.h>
+# include <linux/mempolicy.h>
+#endif
+
+#include "convert.h"
+
+using namespace std;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+
+#define SYS_NODE_DIR "/sys/devices/system/node"
+
+namespace {
+
+struct slot {
+    vector<int> cpus;
+
+    // The NUMA nodes of cpus - empty if the machine only has one.
+    vector<int> nodes;
+};
+
+}
+
+static vector<slot> slots;
+
+// Parse a list of CPUs or nodes in the format the kernel uses, such as
+// "0-7,16-23", appending them to out.
+static bool
+parse_list(const char * p, vector<int> & out)
+{
+    while (true) {
+	char * end;
+	long first = strtol(p, &end, 10);
+	if (end == p || first < 0 || first >= CPU_SETSIZE) return false;
+	long last = first;
+	p = end;
+	if (*p == '-') {
+	    ++p;
+	    last = strtol(p, &end, 10);
+	    if (end == p || last < first || last >= CPU_SETSIZE) return false;
+	    p = end;
+	}
+	for (long i = first; i <= last; ++i) out.push_back(int(i));
+	if (*p != ',') break;
+	++p;
+    }
+    return *p == '\0' || *p == '\n';
+}
+
+static void
+write_list(ostream & os, const vector<int> & v)
+{
+    for (size_t i = 0; i < v.size(); ) {
+	size_t j = i;
+	while (j + 1 < v.size() && v[j + 1] == v[j] + 1) ++j;
+	if (i) os << ',';
+	os << v[i];
+	if (j != i) os << '-' << v[j];
+	i = j + 1;
+    }
+}
+
+// Find which NUMA node each CPU is on.
+static map<int, int>
+read_cpu_nodes()
+{
+    map<int, int> cpu_node;
+    DIR * dir = opendir(SYS_NODE_DIR);
+    if (!dir) return cpu_node;
+    struct dirent * d;
+    while ((d = readdir(dir))) {
+	int node;
+	if (sscanf(d->d_name, "node%d", &node) != 1) continue;
+	string path = SYS_NODE_DIR "/";
+	path += d->d_name;
+	path += "/cpulist";
+	FILE * f = fopen(path.c_str(), "r");
+	if (!f) continue;
+	char buf[4096];
+	vector<int> cpus;
+	if (fgets(buf, sizeof(buf), f) && parse_list(buf, cpus)) {
+	    for (int cpu : cpus) cpu_node[cpu] = node;
+	}
+	fclose(f);
+    }
+    closedir(dir);
+    return cpu_node;
+}
+
+static void
+apply(const slot & s)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : s.cpus) CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+	perror("sched_setaffinity");
+    }
+#ifdef HAVE_LINUX_MEMPOLICY_H
+    if (!s.nodes.empty()) {
+	const size_t bits = sizeof(unsigned long) * 8;
+	vector<unsigned long> mask(s.nodes.back() / bits + 1);
+	for (int node : s.nodes) mask[node / bits] |= 1ul << (node % bits);
+	// The kernel ignores the last bit of maxnode.
+	if (syscall(SYS_set_mempolicy, MPOL_BIND, mask.data(),
+		    mask.size() * bits + 1) < 0) {
+	    perror("set_mempolicy");
+	}
+    }
+#endif
+}
+
+bool
+placement_setup(const char * cpus, bool pin, unsigned nslots)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+	perror("sched_getaffinity");
+	return false;
+    }
+    vector<int> use;
+    if (cpus) {
+	if (!parse_list(cpus, use)) {
+	    cerr << program << ": '" << cpus << "' isn't a list of CPUs "
+		    "such as 0-7,16-23\n";
+	    return false;
+	}
+	for (int cpu : use) {
+	    if (!CPU_ISSET(cpu, &allowed)) {
+		cerr << program << ": CPU " << cpu << " isn't available\n";
+		return false;
+	    }
+	}
+    } else {
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+	    if (CPU_ISSET(cpu, &allowed)) use.push_back(cpu);
+	}
+    }
+
+    // Order the CPUs by NUMA node, so consecutive runs share a node.
+    map<int, int> cpu_node = read_cpu_nodes();
+    vector<int> all_nodes;
+    for (auto & i : cpu_node) all_nodes.push_back(i.second);
+    sort(all_nodes.begin(), all_nodes.end());
+    all_nodes.erase(unique(all_nodes.begin(), all_nodes.end()),
+		    all_nodes.end());
+    bool numa = all_nodes.size() > 1;
+    auto node_of = [&](int cpu) {
+	auto i = cpu_node.find(cpu);
+	return i == cpu_node.end() ? -1 : i->second;
+    };
+    sort(use.begin(), use.end());
+    use.erase(unique(use.begin(), use.end()), use.end());
+    stable_sort(use.begin(), use.end(), [&](int a, int b) {
+	return node_of(a) < node_of(b);
+    });
+
+    auto make_slot = [&](vector<int> slot_cpus) {
+	slot s;
+	for (int cpu : slot_cpus) {
+	    if (numa && node_of(cpu) >= 0) s.nodes.push_back(node_of(cpu));
+	}
+	sort(slot_cpus.begin(), slot_cpus.end());
+	s.cpus = std::move(slot_cpus);
+	sort(s.nodes.begin(), s.nodes.end());
+	s.nodes.erase(unique(s.nodes.begin(), s.nodes.end()), s.nodes.end());
+	return s;
+    };
+
+    slots.clear();
+    if (pin && nslots > 1) {
+	size_t n = use.size();
+	for (unsigned k = 0; k < nslots; ++k) {
+	    if (nslots <= n) {
+		slots.push_back(make_slot(vector<int>(use.begin() + k * n / nslots,
+						      use.begin() + (k + 1) * n / nslots)));
+	    } else {
+		// More slots than CPUs, so some have to share.
+		slots.push_back(make_slot(vector<int>(1, use[k * n / nslots])));
+	    }
+	}
+    } else {
+	slots.push_back(make_slot(use));
+    }
+
+    apply(make_slot(use));
+    return true;
+}
+
+void
+placement_report(ostream & os)
+{
+    for (size_t k = 0; k < slots.size(); ++k) {
+	os << program << ": ";
+	if (slots.size() > 1) {
+	    os << "process " << k << " uses ";
+	} else {
+	    os << "conversions use ";
+	}
+	os << "CPU" << (slots[k].cpus.size() == 1 ? " " : "s ");
+	write_list(os, slots[k].cpus);
+	if (!slots[k].nodes.empty()) {
+	    os << " with memory on NUMA node"
+	       << (slots[k].nodes.size() == 1 ? " " : "s ");
+	    write_list(os, slots[k].nodes);
+	}
+	os << '\n';
+    }
+}
+
+void
+placement_apply(unsigned k)
+{
+    if (slots.size() > 1) apply(slots[k % slots.size()]);
+}
+
+#else
+
+bool
+placement_setup(const char *, bool, unsigned)
+{
+    cerr << program << ": Placing processes on CPUs isn't supported on "
+	    "this platform\n";
+    return false;
+}
+
+void
+placement_report(ostream &)
+{
+}
+
+void
+placement_apply(unsigned)
+{
+}
+
+#endif
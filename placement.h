@@ -0,0 +1,32 @@
+/* placement.h - Place conversion processes on CPUs and NUMA nodes
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PLACEMENT_H
+#define INCLUDED_PLACEMENT_H
+
+#include <ostream>
+
+// Set up placement for up to nslots conversion processes using the CPUs in
+// cpus (a list such as "0-7,16-23", or NULL for all those we may run on).
+// If pin is true, the CPUs are divided between the slots, keeping each
+// slot's share on as few NUMA nodes as possible, otherwise every slot may
+// use all of them.  Memory is bound to the NUMA nodes of the CPUs used.
+// This process is restricted to the CPUs and their NUMA nodes straight away.
+//
+// Returns false (having reported the problem) if cpus isn't valid.
+bool placement_setup(const char * cpus, bool pin, unsigned nslots);
+
+// Report the placement of each slot.
+void placement_report(std::ostream & os);
+
+// Apply the placement for slot to the calling process.  Does nothing unless
+// placement_setup() has been called.
+void placement_apply(unsigned slot);
+
+#endif
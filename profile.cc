@@ -0,0 +1,251 @@
+/* profile.cc - Reuse a LibreOffice user profile between runs
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "profile.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+#include "convert.h"
+#include "fileutils.h"
+#include "urlencode.h"
+
+using namespace std;
+
+#define TEMP_DIR_TEMPLATE "/lloconv-profile-XXXXXX"
+
+// Set by convert_set_profile().
+static bool profile_dir_set = false;
+static string profile_dir;
+
+// The URL we last worked out, and the process it was worked out for.
+static string profile_url;
+static pid_t profile_pid = 0;
+
+// Our private copy of a template profile, if we made one.
+static string profile_copy;
+
+// After preinitialisation LibreOfficeKit ignores the profile passed when
+// initialising, so processes forked after that must stick with the same one.
+static bool preinitialised = false;
+
+void
+convert_set_profile(const char * dir)
+{
+    profile_dir_set = true;
+    profile_dir = dir;
+    profile_url.clear();
+}
+
+static bool
+is_template(const string & dir)
+{
+    struct stat sb;
+    return stat((dir + "/" PROFILE_TEMPLATE_MARKER).c_str(), &sb) == 0;
+}
+
+bool
+convert_profile_url(string & url, string & errmsg)
+{
+    if (!profile_url.empty() && (preinitialised || profile_pid == getpid())) {
+	url = profile_url;
+	return true;
+    }
+
+    string dir;
+    if (profile_dir_set) {
+	dir = profile_dir;
+    } else {
+	const char * p = getenv("LLOCONV_PROFILE");
+	if (p) dir = p;
+    }
+    if (dir.empty()) {
+	url.clear();
+	return true;
+    }
+
+    char * abs = realpath(dir.c_str(), NULL);
+    if (!abs) {
+	errmsg = "Profile directory '" + dir + "' not usable (";
+	errmsg += strerror(errno);
+	errmsg += ')';
+	return false;
+    }
+    string path = abs;
+    free(abs);
+
+    if (is_template(path)) {
+	// LibreOffice writes to its profile as it runs, so each process needs
+	// its own copy.  That's cheap compared to LibreOffice creating a
+	// profile from scratch, especially if the copy can share data blocks.
+	const char * tmpdir = getenv("TMPDIR");
+	if (!tmpdir) tmpdir = "/tmp";
+	string copy = tmpdir;
+	copy += TEMP_DIR_TEMPLATE;
+	if (!mkdtemp(&copy[0])) {
+	    errmsg = "mkdtemp() failed (";
+	    errmsg += strerror(errno);
+	    errmsg += ')';
+	    return false;
+	}
+	string user = copy + "/user";
+	if (!copy_tree(path, user)) {
+	    errmsg = "Failed to copy template profile '" + path + "' (";
+	    errmsg += strerror(errno);
+	    errmsg += ')';
+	    remove_tree(copy);
+	    return false;
+	}
+	unlink((user + "/" PROFILE_TEMPLATE_MARKER).c_str());
+	profile_copy = copy;
+	path = user;
+    }
+
+    profile_url = "file://";
+    url_encode_path(profile_url, path);
+    profile_pid = getpid();
+    url = profile_url;
+    return true;
+}
+
+void
+convert_profile_preinit()
+{
+    preinitialised = true;
+}
+
+void
+convert_discard_profile()
+{
+    // A forked child shares its parent's copy, so mustn't remove it.
+    if (profile_copy.empty() || profile_pid != getpid()) return;
+    remove_tree(profile_copy);
+    profile_copy.clear();
+    profile_url.clear();
+}
+
+// Remove write permission from path and everything below it.
+static void
+make_read_only(const string & path)
+{
+    struct stat sb;
+    if (lstat(path.c_str(), &sb) < 0 || S_ISLNK(sb.st_mode)) return;
+    if (S_ISDIR(sb.st_mode)) {
+	DIR * dir = opendir(path.c_str());
+	if (dir) {
+	    struct dirent * d;
+	    while ((d = readdir(dir))) {
+		const char * leaf = d->d_name;
+		if (is_dot_or_dotdot(leaf)) continue;
+		make_read_only(path + '/' + leaf);
+	    }
+	    closedir(dir);
+	}
+    }
+    chmod(path.c_str(), sb.st_mode & 0555);
+}
+
+int
+convert_prepare_profile(const char * dir, bool verbose)
+{
+    if (!mkdir_p(dir)) {
+	cerr << program << ": Failed to create directory '" << dir << "' ("
+	     << strerror(errno) << ")\n";
+	return EX_CANTCREAT;
+    }
+    DIR * d = opendir(dir);
+    if (!d) {
+	cerr << program << ": Failed to open directory '" << dir << "' ("
+	     << strerror(errno) << ")\n";
+	return EX_CANTCREAT;
+    }
+    bool empty = true;
+    struct dirent * entry;
+    while ((entry = readdir(d))) {
+	if (!is_dot_or_dotdot(entry->d_name)) {
+	    empty = false;
+	    break;
+	}
+    }
+    closedir(d);
+    if (!empty) {
+	cerr << program << ": Directory '" << dir << "' isn't empty\n";
+	return EX_CANTCREAT;
+    }
+
+    convert_set_profile(dir);
+    double t = now();
+    void * handle = convert_init();
+    if (!handle) {
+	return EX_UNAVAILABLE;
+    }
+    if (verbose) {
+	cerr << program << ": initialised LibreOfficeKit with a new profile "
+		"in " << (now() - t) * 1e3 << "ms\n";
+    }
+
+    // Run a document through a commonly used import filter and a couple of
+    // export filters so the profile has whatever they set up on first use.
+    const char * tmpdir = getenv("TMPDIR");
+    if (!tmpdir) tmpdir = "/tmp";
+    string work = tmpdir;
+    work += "/lloconv-warm-XXXXXX";
+    if (!mkdtemp(&work[0])) {
+	cerr << program << ": mkdtemp() failed (" << strerror(errno) << ")\n";
+	convert_cleanup(handle);
+	return 1;
+    }
+    string txt = work + "/warm.txt";
+    string odt = work + "/warm.odt";
+    string pdf = work + "/warm.pdf";
+    FILE * f = fopen(txt.c_str(), "w");
+    if (f) {
+	fputs("lloconv\n", f);
+	fclose(f);
+    }
+    t = now();
+    int rc = convert(handle, false, txt.c_str(), odt.c_str(), "odt");
+    if (rc == 0) {
+	rc = convert(handle, false, odt.c_str(), pdf.c_str(), "pdf");
+    }
+    remove_tree(work);
+    if (verbose && rc == 0) {
+	cerr << program << ": warm-up conversions took "
+	     << (now() - t) * 1e3 << "ms\n";
+    }
+
+    // LibreOffice writes out its configuration as it shuts down.
+    convert_cleanup(handle);
+    if (rc != 0) {
+	return rc;
+    }
+
+    string marker = dir;
+    marker += "/" PROFILE_TEMPLATE_MARKER;
+    f = fopen(marker.c_str(), "w");
+    bool ok = f && fputs("lloconv template profile\n", f) >= 0;
+    if (f && fclose(f) != 0) ok = false;
+    if (!ok) {
+	cerr << program << ": Failed to write '" << marker << "'\n";
+	return EX_CANTCREAT;
+    }
+    make_read_only(dir);
+    return 0;
+}
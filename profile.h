@@ -0,0 +1,44 @@
+/* profile.h - Reuse a LibreOffice user profile between runs
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PROFILE_H
+#define INCLUDED_PROFILE_H
+
+#include <string>
+
+// Name of the file marking a directory as a template profile.
+#define PROFILE_TEMPLATE_MARKER "lloconv-template"
+
+// Have LibreOffice use the user profile in directory dir rather than
+// creating a new one in a temporary directory, which is a large part of its
+// start-up time.  If dir was set up by convert_prepare_profile() then each
+// process uses a private copy of it.  If this isn't called the
+// LLOCONV_PROFILE environment variable is used if set.
+void convert_set_profile(const char * dir);
+
+// Create a profile in dir (which must not exist or be empty) suitable for
+// passing to convert_set_profile() by starting LibreOffice there and running
+// a few conversions, then marking it as a template and making it read-only.
+// Returns an exit status.
+int convert_prepare_profile(const char * dir, bool verbose);
+
+// Remove this process's copy of a template profile if it made one.  This
+// is done by convert_cleanup(), but processes which skip that and call
+// _Exit() directly should call this first.
+void convert_discard_profile();
+
+// Set url to the user profile URL to pass to LibreOfficeKit, or to an empty
+// string for the default.  Returns false and sets errmsg on failure.
+bool convert_profile_url(std::string & url, std::string & errmsg);
+
+// Note that LibreOfficeKit has been preinitialised, after which the profile
+// can't be changed.
+void convert_profile_preinit();
+
+#endif
@@ -0,0 +1,342 @@
+/* tree.cc - Incrementally convert a directory tree
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "tree.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+#include "convert.h"
+#include "fileutils.h"
+#include "manifest.h"
+#include "workers.h"
+
+using namespace std;
+
+// Outputs are written to a temporary file with this prefix in the same
+// directory, then renamed into place.
+#define TMP_PREFIX ".lloconv-tmp-"
+
+// How often to save the manifest while converting, so that an interrupted
+// run doesn't have to start again from scratch.
+#define MANIFEST_SAVE_INTERVAL 60
+
+namespace {
+
+struct tree_file {
+    // Path relative to the top of the tree.
+    string rel;
+
+    manifest_entry e;
+};
+
+}
+
+// Find the regular files under src/rel.  Symlinks aren't followed.  Returns
+// false if any directory couldn't be read.
+static bool
+walk(const string & src, const string & rel, const struct stat & dst_sb,
+     vector<tree_file> & files)
+{
+    string dir = rel.empty() ? src : src + '/' + rel;
+    DIR * d = opendir(dir.c_str());
+    if (!d) {
+	cerr << program << ": " << dir << ": " << strerror(errno) << '\n';
+	return false;
+    }
+    bool ok = true;
+    // Recurse after closing d so that we don't have a directory handle open
+    // for every level of the tree.
+    vector<string> subdirs;
+    struct dirent * ent;
+    while ((ent = readdir(d))) {
+	const char * name = ent->d_name;
+	if (is_dot_or_dotdot(name)) continue;
+	string r = rel.empty() ? string(name) : rel + '/' + name;
+	struct stat sb;
+	if (lstat((src + '/' + r).c_str(), &sb) < 0) {
+	    // Probably removed since we read the directory.
+	    continue;
+	}
+	if (S_ISDIR(sb.st_mode)) {
+	    // Don't descend into the output tree if it's inside the input tree.
+	    if (sb.st_dev == dst_sb.st_dev && sb.st_ino == dst_sb.st_ino) {
+		continue;
+	    }
+	    subdirs.push_back(r);
+	} else if (S_ISREG(sb.st_mode)) {
+	    tree_file f;
+	    f.rel = r;
+	    f.e.size = sb.st_size;
+	    f.e.mtime = stat_mtime(sb);
+	    files.push_back(f);
+	}
+    }
+    closedir(d);
+    for (const string & subdir : subdirs) {
+	if (!walk(src, subdir, dst_sb, files)) ok = false;
+    }
+    return ok;
+}
+
+string
+output_path(const string & dst, const string & rel, const char * format)
+{
+    string out = dst;
+    out += '/';
+    out += rel;
+    out += '.';
+    out += format;
+    return out;
+}
+
+int
+convert_replacing(void * handle, const string & input, const string & output,
+		  const char * format, const char * options)
+{
+    string::size_type slash = output.rfind('/');
+    string dir(output, 0, slash == string::npos ? 0 : slash);
+    if (dir.empty()) dir = slash == 0 ? "/" : ".";
+    if (!mkdir_p(dir)) {
+	cerr << program << ": " << dir << ": " << strerror(errno) << '\n';
+	return 1;
+    }
+    string tmp = dir + "/" TMP_PREFIX;
+    tmp += to_string(getpid());
+    tmp += '-';
+    tmp.append(output, slash == string::npos ? 0 : slash + 1, string::npos);
+    int rc = convert(handle, false, input.c_str(), tmp.c_str(),
+		     format, options);
+    if (rc == 0 && rename(tmp.c_str(), output.c_str()) < 0) {
+	cerr << program << ": " << output << ": " << strerror(errno) << '\n';
+	rc = 1;
+    }
+    if (rc != 0) {
+	unlink(tmp.c_str());
+    }
+    return rc;
+}
+
+// Remove temporary files under dir left by convert_replacing() in processes
+// which are no longer running, for example because they crashed part way
+// through a conversion.
+static void
+remove_stale_tmp(const string & dir)
+{
+    DIR * d = opendir(dir.c_str());
+    if (!d) return;
+    vector<string> subdirs;
+    struct dirent * ent;
+    while ((ent = readdir(d))) {
+	const char * name = ent->d_name;
+	if (is_dot_or_dotdot(name)) continue;
+	string path = dir + '/' + name;
+	struct stat sb;
+	if (lstat(path.c_str(), &sb) < 0) continue;
+	if (S_ISDIR(sb.st_mode)) {
+	    subdirs.push_back(path);
+	    continue;
+	}
+	if (!S_ISREG(sb.st_mode) ||
+	    strncmp(name, TMP_PREFIX, strlen(TMP_PREFIX)) != 0) {
+	    continue;
+	}
+	char * end;
+	long pid = strtol(name + strlen(TMP_PREFIX), &end, 10);
+	if (*end == '-' && pid > 0 && kill(pid_t(pid), 0) < 0 &&
+	    errno == ESRCH) {
+	    unlink(path.c_str());
+	}
+    }
+    closedir(d);
+    for (const string & subdir : subdirs) {
+	remove_stale_tmp(subdir);
+    }
+}
+
+// Remove output and any directories above it in dst left empty as a result.
+static void
+remove_output(const string & dst, const string & output)
+{
+    if (unlink(output.c_str()) < 0 && errno != ENOENT) {
+	cerr << program << ": " << output << ": " << strerror(errno) << '\n';
+	return;
+    }
+    string dir = output;
+    while (true) {
+	string::size_type slash = dir.rfind('/');
+	if (slash == string::npos || slash <= dst.size()) break;
+	dir.resize(slash);
+	if (rmdir(dir.c_str()) < 0) break;
+    }
+}
+
+int
+convert_tree(const char * src, const char * dst,
+	     const char * format, const char * options,
+	     unsigned jobs, bool verbose)
+{
+    string src_dir(src);
+    string dst_dir(dst);
+    while (src_dir.size() > 1 && src_dir.back() == '/') src_dir.pop_back();
+    while (dst_dir.size() > 1 && dst_dir.back() == '/') dst_dir.pop_back();
+    if (!options) options = "";
+
+    struct stat dst_sb;
+    if (!mkdir_p(dst_dir) || stat(dst_dir.c_str(), &dst_sb) < 0) {
+	cerr << program << ": " << dst_dir << ": " << strerror(errno) << '\n';
+	return 1;
+    }
+    struct stat src_sb;
+    if (stat(src_dir.c_str(), &src_sb) < 0) {
+	cerr << program << ": " << src_dir << ": " << strerror(errno) << '\n';
+	return 1;
+    }
+    // Otherwise we'd convert our own outputs, and their outputs next time.
+    if (src_sb.st_dev == dst_sb.st_dev && src_sb.st_ino == dst_sb.st_ino) {
+	cerr << program << ": The output directory can't be the input "
+		"directory\n";
+	return EX_USAGE;
+    }
+
+    string manifest_path = dst_dir + "/" MANIFEST_NAME;
+    manifest m;
+    if (!m.load(manifest_path)) {
+	return 1;
+    }
+    // If the format or options have changed then everything needs
+    // converting again, but we still need the old entries so we know which
+    // outputs to remove.
+    bool all_stale = m.format != format || m.options != options;
+    // The format the existing outputs were converted to.
+    string old_format = m.format;
+    m.format = format;
+    m.options = options;
+
+    remove_stale_tmp(dst_dir);
+
+    vector<tree_file> files;
+    bool walk_ok = walk(src_dir, string(), dst_sb, files);
+
+    vector<string> present;
+    present.reserve(files.size());
+    for (const tree_file & f : files) present.push_back(f.rel);
+    sort(present.begin(), present.end());
+
+    size_t unchanged = 0;
+    vector<tree_file> todo;
+    for (tree_file & f : files) {
+	auto i = m.entries.find(f.rel);
+	if (i != m.entries.end() && !all_stale) {
+	    const manifest_entry & old = i->second;
+	    if (old.size == f.e.size && old.mtime == f.e.mtime) {
+		++unchanged;
+		continue;
+	    }
+	}
+	if (!hash_file(src_dir + '/' + f.rel, f.e.hash)) {
+	    // Probably removed since we walked the tree.
+	    continue;
+	}
+	if (i != m.entries.end() && !all_stale) {
+	    manifest_entry & old = i->second;
+	    if (old.size == f.e.size && old.hash == f.e.hash) {
+		// Touched, but the contents are the same.
+		old.mtime = f.e.mtime;
+		++unchanged;
+		continue;
+	    }
+	}
+	todo.push_back(std::move(f));
+    }
+
+    // Propagate removals, unless we failed to read part of the input tree in
+    // which case we can't tell what's been removed.
+    size_t removed = 0;
+    if (walk_ok) {
+	auto i = m.entries.begin();
+	while (i != m.entries.end()) {
+	    if (binary_search(present.begin(), present.end(), i->first)) {
+		++i;
+		continue;
+	    }
+	    remove_output(dst_dir,
+			  output_path(dst_dir, i->first, old_format.c_str()));
+	    i = m.entries.erase(i);
+	    ++removed;
+	}
+    }
+
+    if (all_stale) {
+	for (auto & entry : m.entries) {
+	    // Outputs in a different format have a different name, so won't
+	    // be replaced.
+	    if (old_format != format) {
+		remove_output(dst_dir, output_path(dst_dir, entry.first,
+						   old_format.c_str()));
+	    }
+	    // Make sure an interrupted run doesn't save a manifest which says
+	    // inputs not yet converted again are up to date.
+	    entry.second = manifest_entry();
+	}
+    }
+
+    size_t converted = 0, failed = 0;
+    time_t last_save = time(NULL);
+    run_workers(todo.size(), jobs,
+		[&](void * handle, size_t i) -> int {
+		    const string & rel = todo[i].rel;
+		    return convert_replacing(handle, src_dir + '/' + rel,
+					     output_path(dst_dir, rel, format),
+					     format,
+					     options[0] ? options : NULL);
+		},
+		[&](size_t i, int status) {
+		    manifest_entry & e = m.entries[todo[i].rel];
+		    if (status == 0) {
+			e = todo[i].e;
+			++converted;
+		    } else {
+			cerr << program << ": Failed to convert '" << src_dir
+			     << '/' << todo[i].rel << "'\n";
+			// Keep the entry so a removal is still noticed, but
+			// make sure it doesn't match next time.
+			e = manifest_entry();
+			++failed;
+		    }
+		    if (time(NULL) - last_save >= MANIFEST_SAVE_INTERVAL) {
+			m.save(manifest_path);
+			last_save = time(NULL);
+		    }
+		});
+
+    bool saved = m.save(manifest_path);
+
+    if (verbose) {
+	cerr << program << ": " << converted << " converted, "
+	     << unchanged << " unchanged, " << removed << " removed, "
+	     << failed << " failed\n";
+    }
+    return (failed || !walk_ok || !saved) ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+/* tree.h - Incrementally convert a directory tree
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TREE_H
+#define INCLUDED_TREE_H
+
+#include <string>
+
+// Name of the manifest file in the output directory.
+#define MANIFEST_NAME ".lloconv-manifest"
+
+// The output path in dst for the input at relative path rel.
+std::string output_path(const std::string & dst, const std::string & rel,
+			const char * format);
+
+// Convert input to output via a temporary file in the same directory, so
+// that output is either untouched or the complete conversion.  output's
+// directory is created if it doesn't exist.  Returns an exit status.
+int convert_replacing(void * handle,
+		      const std::string & input, const std::string & output,
+		      const char * format, const char * options);
+
+// Convert each file under src to format, writing the output to the same
+// relative path under dst with "." + format appended.  Files which haven't
+// changed since the last run are skipped, and outputs of files which have
+// since been removed are deleted.  Returns an exit status.
+int convert_tree(const char * src, const char * dst,
+		 const char * format, const char * options,
+		 unsigned jobs, bool verbose);
+
+#endif
@@ -0,0 +1,344 @@
+/* watch.cc - Convert files as they appear in a directory
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "watch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sysexits.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#include "convert.h"
+#include "fileutils.h"
+#include "manifest.h"
+#include "tree.h"
+
+using namespace std;
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+// How long a file must go without being written to before we convert it, in
+// seconds.  IN_CLOSE_WRITE means the writer has closed the file, but some
+// writers close and reopen files several times while creating them.
+#define SETTLE_TIME 0.5
+
+// Maximum number of files waiting to be converted.  If more arrive we stop
+// tracking them individually and rescan the directory once we've caught up.
+#define MAX_PENDING 10000
+
+// File in the output directory naming the file being converted, so if that
+// file crashes LibreOffice we don't keep retrying it on every restart.
+#define IN_PROGRESS_NAME ".lloconv-watch-in-progress"
+
+namespace {
+
+struct pending_file {
+    string name;
+
+    // When the file first appeared.
+    double arrived;
+
+    // When the file was last written to.
+    double last_event;
+};
+
+}
+
+// Files waiting to be converted in order of arrival, and an index into it by
+// name so repeated events for the same file can be coalesced.
+static list<pending_file> pending;
+static map<string, list<pending_file>::iterator> pending_by_name;
+
+// Set if we've missed events and need to rescan the directory.
+static bool rescan_needed = false;
+
+static void
+enqueue(const string & name, double t)
+{
+    // Dotfiles are commonly used for files which are still being written
+    // (e.g. by rsync) and then renamed into place.
+    if (name.empty() || name[0] == '.') return;
+    auto i = pending_by_name.find(name);
+    if (i != pending_by_name.end()) {
+	i->second->last_event = t;
+	return;
+    }
+    if (pending.size() >= MAX_PENDING) {
+	rescan_needed = true;
+	return;
+    }
+    pending_file f;
+    f.name = name;
+    f.arrived = t;
+    f.last_event = t;
+    pending_by_name[name] = pending.insert(pending.end(), f);
+}
+
+static bool
+up_to_date(const manifest & m, const string & name, const struct stat & sb)
+{
+    auto i = m.entries.find(name);
+    return i != m.entries.end() &&
+	   i->second.size == uint64_t(sb.st_size) &&
+	   i->second.mtime == stat_mtime(sb);
+}
+
+// Queue files in dir which we haven't converted, oldest first.  Also drop
+// manifest entries for files which are no longer there.
+static void
+scan(const string & dir, manifest & m)
+{
+    DIR * d = opendir(dir.c_str());
+    if (!d) {
+	cerr << program << ": " << dir << ": " << strerror(errno) << '\n';
+	return;
+    }
+    vector<pair<int64_t, string>> found;
+    map<string, manifest_entry> still_present;
+    struct dirent * ent;
+    while ((ent = readdir(d))) {
+	string name(ent->d_name);
+	if (name[0] == '.') continue;
+	struct stat sb;
+	if (stat((dir + '/' + name).c_str(), &sb) < 0 || !S_ISREG(sb.st_mode)) {
+	    continue;
+	}
+	auto i = m.entries.find(name);
+	if (i != m.entries.end()) {
+	    still_present.insert(*i);
+	}
+	if (!up_to_date(m, name, sb)) {
+	    found.emplace_back(stat_mtime(sb), name);
+	}
+    }
+    closedir(d);
+    m.entries.swap(still_present);
+
+    sort(found.begin(), found.end());
+    // Treat them as having settled already.
+    double t = now() - SETTLE_TIME;
+    for (const auto & f : found) {
+	enqueue(f.second, t);
+    }
+}
+
+int
+convert_watch(const char * dir, const char * out_dir,
+	      const char * format, const char * options, bool verbose)
+{
+    string in_dir(dir);
+    string dst_dir(out_dir);
+    while (in_dir.size() > 1 && in_dir.back() == '/') in_dir.pop_back();
+    while (dst_dir.size() > 1 && dst_dir.back() == '/') dst_dir.pop_back();
+
+    // Watch before the initial scan so we can't miss a file which arrives
+    // in between.
+    int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (ifd < 0) {
+	perror("inotify_init1");
+	return 1;
+    }
+    if (inotify_add_watch(ifd, in_dir.c_str(),
+			  IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+			  IN_MOVED_FROM | IN_ONLYDIR) < 0) {
+	cerr << program << ": " << in_dir << ": " << strerror(errno) << '\n';
+	return 1;
+    }
+
+    struct stat in_sb, dst_sb;
+    if (!mkdir_p(dst_dir) || stat(dst_dir.c_str(), &dst_sb) < 0) {
+	cerr << program << ": " << dst_dir << ": " << strerror(errno) << '\n';
+	return 1;
+    }
+    if (stat(in_dir.c_str(), &in_sb) < 0) {
+	cerr << program << ": " << in_dir << ": " << strerror(errno) << '\n';
+	return 1;
+    }
+    // Otherwise each output would appear in the watched directory and get
+    // converted in turn.
+    if (in_sb.st_dev == dst_sb.st_dev && in_sb.st_ino == dst_sb.st_ino) {
+	cerr << program << ": The output directory can't be the directory "
+		"being watched\n";
+	return EX_USAGE;
+    }
+
+    string manifest_path = dst_dir + "/" MANIFEST_NAME;
+    string in_progress_path = dst_dir + "/" IN_PROGRESS_NAME;
+    manifest m;
+    if (!m.load(manifest_path)) {
+	return 1;
+    }
+    if (m.format != format || m.options != (options ? options : "")) {
+	m.entries.clear();
+	m.format = format;
+	m.options = options ? options : "";
+    }
+
+    // If we were converting a file when we last stopped, it probably
+    // crashed LibreOffice, so record it as done rather than retrying it.
+    FILE * f = fopen(in_progress_path.c_str(), "r");
+    if (f) {
+	char * line = NULL;
+	size_t len = 0;
+	ssize_t c = getline(&line, &len, f);
+	fclose(f);
+	if (c > 0) {
+	    string name(line, c);
+	    struct stat sb;
+	    if (stat((in_dir + '/' + name).c_str(), &sb) == 0) {
+		cerr << program << ": Skipping '" << name << "' which was "
+			"being converted when we last stopped\n";
+		manifest_entry & e = m.entries[name];
+		e.size = sb.st_size;
+		e.mtime = stat_mtime(sb);
+	    }
+	}
+	free(line);
+	m.save(manifest_path);
+	unlink(in_progress_path.c_str());
+    }
+
+    void * handle = convert_init();
+    if (!handle) {
+	return EX_UNAVAILABLE;
+    }
+
+    scan(in_dir, m);
+
+    alignas(struct inotify_event) char buf[65536];
+    while (true) {
+	double t = now();
+	int timeout = -1;
+	list<pending_file>::iterator ready = pending.end();
+	for (auto i = pending.begin(); i != pending.end(); ++i) {
+	    double wait = i->last_event + SETTLE_TIME - t;
+	    if (wait <= 0) {
+		ready = i;
+		timeout = 0;
+		break;
+	    }
+	    int ms = int(wait * 1000) + 1;
+	    if (timeout < 0 || ms < timeout) timeout = ms;
+	}
+
+	double ready_event = ready == pending.end() ? 0 : ready->last_event;
+
+	struct pollfd pfd;
+	pfd.fd = ifd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) < 0) {
+	    if (errno == EINTR) continue;
+	    perror("poll");
+	    return 1;
+	}
+	if (pfd.revents) {
+	    ssize_t n;
+	    while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+		t = now();
+		for (char * p = buf; p < buf + n; ) {
+		    struct inotify_event * ev =
+			reinterpret_cast<struct inotify_event *>(p);
+		    p += sizeof(struct inotify_event) + ev->len;
+		    if (ev->mask & IN_Q_OVERFLOW) {
+			rescan_needed = true;
+		    } else if (ev->mask & IN_IGNORED) {
+			cerr << program << ": " << in_dir << ": No longer "
+				"being watched\n";
+			return 1;
+		    } else if (!ev->len) {
+			continue;
+		    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			// Forget files which are gone, so the manifest we
+			// rewrite after each conversion doesn't keep growing
+			// when files are consumed downstream.  The manifest
+			// gets saved after the next conversion.
+			m.entries.erase(ev->name);
+		    } else {
+			enqueue(ev->name, t);
+		    }
+		}
+	    }
+	    // Only go back to waiting if new events pushed back the file we
+	    // picked, so a steady stream of events for other files can't
+	    // stop us converting.
+	    if (ready == pending.end() || ready->last_event != ready_event) {
+		continue;
+	    }
+	}
+
+	if (ready == pending.end()) {
+	    if (rescan_needed && pending.size() < MAX_PENDING / 2) {
+		rescan_needed = false;
+		scan(in_dir, m);
+	    }
+	    continue;
+	}
+
+	pending_file file = *ready;
+	pending_by_name.erase(file.name);
+	pending.erase(ready);
+
+	string input = in_dir + '/' + file.name;
+	struct stat sb;
+	if (stat(input.c_str(), &sb) < 0 || !S_ISREG(sb.st_mode) ||
+	    up_to_date(m, file.name, sb)) {
+	    continue;
+	}
+
+	f = fopen(in_progress_path.c_str(), "w");
+	if (f) {
+	    fputs(file.name.c_str(), f);
+	    fclose(f);
+	}
+	int rc = convert_replacing(handle, input,
+				   output_path(dst_dir, file.name, format),
+				   format, options);
+	if (rc != 0) {
+	    cerr << program << ": Failed to convert '" << input << "'\n";
+	} else if (verbose) {
+	    cerr << program << ": converted '" << file.name << "' "
+		 << (now() - file.arrived) * 1e3 << "ms after it arrived\n";
+	}
+	// Record failures too, so we don't retry a file until it changes.
+	manifest_entry & e = m.entries[file.name];
+	e.size = sb.st_size;
+	e.mtime = stat_mtime(sb);
+	m.save(manifest_path);
+	unlink(in_progress_path.c_str());
+    }
+}
+
+#else
+
+int
+convert_watch(const char *, const char *, const char *, const char *, bool)
+{
+    cerr << program << ": --watch isn't supported on this platform\n";
+    return EX_UNAVAILABLE;
+}
+
+#endif
@@ -0,0 +1,20 @@
+/* watch.h - Convert files as they appear in a directory
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_WATCH_H
+#define INCLUDED_WATCH_H
+
+// Convert each file in dir (including those already there) to format,
+// writing the output to out_dir with "." + format appended, then wait for
+// more files to appear and convert those.  Only returns on error, with an
+// exit status.
+int convert_watch(const char * dir, const char * out_dir,
+		  const char * format, const char * options, bool verbose);
+
+#endif
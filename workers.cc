@@ -0,0 +1,251 @@
+/* workers.cc - Run conversions in a pool of worker processes
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "workers.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "placement.h"
+#include "profile.h"
+
+using namespace std;
+
+namespace {
+
+struct worker {
+    pid_t pid = -1;
+
+    // Our end of the socket pair used to talk to the worker.
+    int fd = -1;
+
+    // The job the worker is running, or -1 if it's idle.
+    long job = -1;
+
+    // The number of jobs the worker has finished.
+    size_t done = 0;
+};
+
+}
+
+static bool
+read_all(int fd, void * buf, size_t count)
+{
+    char * p = static_cast<char *>(buf);
+    while (count) {
+	ssize_t r = read(fd, p, count);
+	if (r <= 0) {
+	    if (r < 0 && errno == EINTR) continue;
+	    return false;
+	}
+	p += r;
+	count -= r;
+    }
+    return true;
+}
+
+static bool
+write_all(int fd, const void * buf, size_t count)
+{
+    const char * p = static_cast<const char *>(buf);
+    while (count) {
+	ssize_t r = write(fd, p, count);
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    return false;
+	}
+	p += r;
+	count -= r;
+    }
+    return true;
+}
+
+unsigned
+default_worker_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? unsigned(n) : 1;
+}
+
+static bool
+start_worker(vector<worker> & workers, size_t w,
+	     const function<int(void *, size_t)> & run_job)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	perror("socketpair");
+	return false;
+    }
+    pid_t child = fork();
+    if (child == -1) {
+	perror("fork");
+	close(sv[0]);
+	close(sv[1]);
+	return false;
+    }
+    if (child == 0) {
+	close(sv[0]);
+	for (const worker & other : workers) {
+	    if (other.fd >= 0) close(other.fd);
+	}
+	placement_apply(w);
+	void * handle = convert_init();
+	if (!handle) {
+	    convert_discard_profile();
+	    _Exit(EX_UNAVAILABLE);
+	}
+	uint32_t job;
+	while (read_all(sv[1], &job, sizeof(job))) {
+	    int32_t status = run_job(handle, job);
+	    if (!write_all(sv[1], &status, sizeof(status))) break;
+	}
+	convert_discard_profile();
+	// Avoid segfault from LibreOffice by terminating swiftly.
+	_Exit(0);
+    }
+    close(sv[1]);
+    workers[w].pid = child;
+    workers[w].fd = sv[0];
+    workers[w].job = -1;
+    workers[w].done = 0;
+    return true;
+}
+
+void
+run_workers(size_t njobs, unsigned nworkers,
+	    const function<int(void *, size_t)> & run_job,
+	    const function<void(size_t, int)> & job_done)
+{
+    if (njobs == 0) return;
+    if (nworkers == 0) nworkers = 1;
+    if (nworkers > njobs) nworkers = njobs;
+
+    // Don't get killed if we try to hand a job to a worker which just died.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Jobs handed back by workers which failed to initialise.
+    deque<size_t> retry;
+    size_t next = 0;
+    size_t finished = 0;
+
+    vector<worker> workers(nworkers);
+    unsigned live = 0;
+    for (size_t w = 0; w != workers.size(); ++w) {
+	if (start_worker(workers, w, run_job)) ++live;
+    }
+
+    vector<struct pollfd> fds(nworkers);
+    while (finished < njobs) {
+	// Give idle workers something to do, or tell them to exit.
+	for (worker & wk : workers) {
+	    if (wk.fd < 0 || wk.job >= 0) continue;
+	    if (!retry.empty()) {
+		wk.job = retry.front();
+		retry.pop_front();
+	    } else if (next < njobs) {
+		wk.job = next++;
+	    } else {
+		close(wk.fd);
+		wk.fd = -1;
+		--live;
+		continue;
+	    }
+	    uint32_t job = wk.job;
+	    // If this fails, the worker has died and we'll see EOF below.
+	    (void)write_all(wk.fd, &job, sizeof(job));
+	}
+
+	if (live == 0) {
+	    cerr << program << ": No worker processes left\n";
+	    while (!retry.empty()) {
+		job_done(retry.front(), EX_UNAVAILABLE);
+		retry.pop_front();
+		++finished;
+	    }
+	    while (next < njobs) {
+		job_done(next++, EX_UNAVAILABLE);
+		++finished;
+	    }
+	    break;
+	}
+
+	for (size_t w = 0; w != workers.size(); ++w) {
+	    fds[w].fd = workers[w].fd;
+	    fds[w].events = POLLIN;
+	    fds[w].revents = 0;
+	}
+	if (poll(fds.data(), fds.size(), -1) < 0) {
+	    if (errno == EINTR) continue;
+	    perror("poll");
+	    break;
+	}
+
+	for (size_t w = 0; w != workers.size(); ++w) {
+	    if (!fds[w].revents) continue;
+	    worker & wk = workers[w];
+	    int32_t status;
+	    if (read_all(wk.fd, &status, sizeof(status))) {
+		job_done(wk.job, status);
+		++finished;
+		++wk.done;
+		wk.job = -1;
+		continue;
+	    }
+
+	    // The worker has died.
+	    close(wk.fd);
+	    wk.fd = -1;
+	    --live;
+	    int wstatus;
+	    waitpid(wk.pid, &wstatus, 0);
+	    wk.pid = -1;
+	    bool init_failed = WIFEXITED(wstatus) &&
+			       WEXITSTATUS(wstatus) == EX_UNAVAILABLE;
+	    if (wk.job >= 0) {
+		if (init_failed) {
+		    retry.push_back(wk.job);
+		} else {
+		    if (WIFSIGNALED(wstatus)) {
+			cerr << program << ": Worker killed by signal "
+			     << WTERMSIG(wstatus) << '\n';
+		    }
+		    job_done(wk.job, 1);
+		    ++finished;
+		}
+		wk.job = -1;
+	    }
+	    // A worker which crashed on a job (perhaps a hostile file) is
+	    // always replaced, but one which failed to initialise only if it
+	    // got somewhere before, or we could keep starting workers which
+	    // fail to initialise.
+	    if ((!init_failed || wk.done) && (next < njobs || !retry.empty())) {
+		if (start_worker(workers, w, run_job)) ++live;
+	    }
+	}
+    }
+
+    for (worker & wk : workers) {
+	if (wk.fd >= 0) close(wk.fd);
+	if (wk.pid > 0) waitpid(wk.pid, NULL, 0);
+    }
+}
@@ -0,0 +1,31 @@
+/* workers.h - Run conversions in a pool of worker processes
+ *
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_WORKERS_H
+#define INCLUDED_WORKERS_H
+
+#include <cstddef>
+#include <functional>
+
+// The number of worker processes to use if the user doesn't say.
+unsigned default_worker_count();
+
+// Run jobs 0 to njobs-1, spread over up to nworkers child processes, each of
+// which initialises LibreOfficeKit once and then runs jobs until there are
+// none left.
+//
+// run_job is called in a worker with its LibreOfficeKit handle and returns
+// the job's exit status.  job_done is called in this process as each job
+// finishes - if a worker dies part way through a job then that job's status
+// is 1 and a new worker takes over its remaining share of the work.
+void run_workers(size_t njobs, unsigned nworkers,
+		 const std::function<int(void *, size_t)> & run_job,
+		 const std::function<void(size_t, int)> & job_done);
+
+#endif